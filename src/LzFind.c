@@ -18,22 +18,30 @@
 #define CRC_INTRINSIC __crc32cw
 #endif
 
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)
+#endif
+
 void MatchFinder_Free(CMatchFinder *p)
 {
   free(p->hash);
 }
 
-void MatchFinder_Create(CMatchFinder *p)
+void MatchFinder_Create(CMatchFinder *p, unsigned hashLog, unsigned hashBytes)
 {
-  //256kb hash, 256kb binary tree
-  p->hash = (UInt32*)malloc(((2 * ZOPFLI_WINDOW_SIZE) + LZFIND_HASH_SIZE) * sizeof(UInt32));
+  p->hashMask = (1u << hashLog) - 1;
+  p->hashBytes = hashBytes;
+  //Up to 128kb hash, 256kb binary tree
+  p->hash = (UInt32*)malloc(MatchFinder_TableSize(p));
   if (!p->hash)
   {
     exit(1);
   }
-  p->son = p->hash + LZFIND_HASH_SIZE;
+  p->son = p->hash + p->hashMask + 1;
 
-  memset(p->hash, 0, LZFIND_HASH_SIZE * sizeof(unsigned));
+  memset(p->hash, 0, (p->hashMask + 1) * sizeof(unsigned));
   p->cyclicBufferPos = 0;
   p->pos = ZOPFLI_WINDOW_SIZE;
 }
@@ -54,6 +62,8 @@ static unsigned short * GetMatches(UInt32 lenLimit, UInt32 curMatch, UInt32 pos,
       return distances;
     }
     UInt32 *pair = son + (((_cyclicBufferPos + ZOPFLI_WINDOW_SIZE - delta) & 32767) << 1);
+    //Load the children of this node while its bytes are compared
+    PREFETCH(pair);
     const Byte *pb = cur - delta;
     UInt32 len = (len0 < len1 ? len0 : len1);
     if (pb[len] == cur[len])
@@ -282,6 +292,7 @@ static void SkipMatches(UInt32 lenLimit, UInt32 curMatch, UInt32 pos, const Byte
     }
 
     UInt32 *pair = son + (((_cyclicBufferPos + ZOPFLI_WINDOW_SIZE - delta) & 32767) << 1);
+    PREFETCH(pair);
     const Byte *pb = cur - delta;
     UInt32 len = (len0 < len1 ? len0 : len1);
     if (pb[len] == cur[len])
@@ -321,10 +332,12 @@ static void SkipMatches2(UInt32 *son, UInt32 _cyclicBufferPos)
   *ptr0 = pair[1];
 }
 
+//The last 3 positions are always hashed with 3 bytes so bytes past the end aren't read.
+#define HASH4(cur) (p->hashBytes == 4 && p->bufend - cur >= 4)
 #ifdef CRC_INTRINSIC
-#define HASH(cur) unsigned v = 0xffffff & *(const unsigned*)cur; UInt32 hashValue = CRC_INTRINSIC(0, v) & LZFIND_HASH_MASK;
+#define HASH(cur) unsigned v = (HASH4(cur) ? 0xffffffff : 0xffffff) & *(const unsigned*)cur; UInt32 hashValue = CRC_INTRINSIC(0, v) & p->hashMask;
 #else
-#define HASH(cur) UInt32 hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ crc[cur[1]]) & LZFIND_HASH_MASK;
+#define HASH(cur) UInt32 hashValue = ((cur[2] | ((UInt32)cur[0] << 8)) ^ crc[cur[1]] ^ (HASH4(cur) ? crc[cur[3]] >> 8 : 0)) & p->hashMask;
 #endif
 
 #define MOVE_POS \
@@ -401,13 +414,15 @@ void Bt3Zip_MatchFinder_Skip2(CMatchFinder* p, UInt32 num)
 }
 
 void CopyMF(const CMatchFinder *p, CMatchFinder* copy){
-  copy->hash = (UInt32*)malloc(((2 * ZOPFLI_WINDOW_SIZE) + LZFIND_HASH_SIZE) * sizeof(UInt32));
+  copy->hash = (UInt32*)malloc(MatchFinder_TableSize(p));
   if (!copy->hash)
   {
     exit(1);
   }
-  copy->son = copy->hash + LZFIND_HASH_SIZE;
-  memcpy(copy->hash, p->hash, ((2 * ZOPFLI_WINDOW_SIZE) + LZFIND_HASH_SIZE) * sizeof(UInt32));
+  copy->son = copy->hash + p->hashMask + 1;
+  memcpy(copy->hash, p->hash, MatchFinder_TableSize(p));
+  copy->hashMask = p->hashMask;
+  copy->hashBytes = p->hashBytes;
 
   copy->cyclicBufferPos = p->cyclicBufferPos;
   copy->pos = p->pos;
@@ -12,10 +12,10 @@ typedef unsigned UInt32;
 
 #define LZFIND_WINDOW_SIZE 32768
 
-//This hash size works well for text and PNG data.
+//This hash size works well for text and PNG data. As the window holds at most 32K positions, larger tables don't
+//pay off. Smaller ones are used for small inputs. The hash size doesn't change the matches that are found.
 #define LZFIND_HASH_LOG 15
-#define LZFIND_HASH_SIZE (1 << LZFIND_HASH_LOG)
-#define LZFIND_HASH_MASK (LZFIND_HASH_SIZE - 1)
+#define LZFIND_MIN_HASH_LOG 10
 
 typedef struct _CMatchFinder
 {
@@ -27,9 +27,13 @@ typedef struct _CMatchFinder
 
   UInt32 *hash;
   UInt32 *son;
+
+  UInt32 hashMask;
+  //3 or 4. Hashing 4 bytes skips over more unrelated positions, but length 3 matches are only found by chance.
+  UInt32 hashBytes;
 } CMatchFinder;
 
-void MatchFinder_Create(CMatchFinder *p);
+void MatchFinder_Create(CMatchFinder *p, unsigned hashLog, unsigned hashBytes);
 void MatchFinder_Free(CMatchFinder *p);
 
 unsigned short Bt3Zip_MatchFinder_GetMatches(CMatchFinder *p, unsigned short* distances);
@@ -40,6 +44,9 @@ void Bt3Zip_MatchFinder_Skip2(CMatchFinder *p, UInt32 num);
 
 void CopyMF(const CMatchFinder *p, CMatchFinder* copy);
 
+//Size of the hash table and binary tree, which are allocated together
+#define MatchFinder_TableSize(p) (((2 * LZFIND_WINDOW_SIZE) + (p)->hashMask + 1) * sizeof(UInt32))
+
 static const unsigned crc[256] = {
   0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
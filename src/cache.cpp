@@ -0,0 +1,110 @@
+//
+//  cache.cpp
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+//  Result cache for repeated runs over the same files. For every file optimized
+//  by ECT a small record holding the resulting size is stored in the cache
+//  directory, named after a hash of the file contents and of the options that
+//  affect the output. A file whose record exists was already produced (or left
+//  unchanged) by an earlier run with the same options and is skipped.
+
+#include "main.h"
+#include "support.h"
+#include "zlib/zlib.h"
+#include <atomic>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#endif
+
+static std::atomic<unsigned> tempcounter;
+
+//Change this whenever the output of ECT changes to invalidate old records
+#define CACHE_FORMAT "ECT 0.9.5 cache 3"
+
+//Hashes everything that changes the output for PNG and JPEG files
+static unsigned long OptionsHash(const ECTOptions& Options){
+    char sig[256];
+    snprintf(sig, sizeof(sig), "%s|%u|%d%d%d%d%d|%u|%d%d%d%d|%u|%u|%u|%g|%u|%u", CACHE_FORMAT, Options.Mode, Options.strip, Options.Strict, Options.Progressive,
+             Options.Arithmetic, Options.Reuse, Options.Autorotate, Options.Allfilters, Options.Allfiltersbrute, Options.Allfilterscheap,
+             Options.PNG_ACTIVE + 2 * Options.JPEG_ACTIVE, Options.AllfiltersTop, Options.palette_sort, Options.DeflateMultithreading, Options.Tuning.convergence, Options.Tuning.optimalsplit, Options.Tuning.speculate);
+    return crc32(0, (const unsigned char*)sig, strlen(sig));
+}
+
+//Returns the path of the record for the current contents of Infile, or an empty string if it can't be read
+static std::string CachePath(const char * Infile, const ECTOptions& Options, long long* size){
+    FILE* stream = fopen(Infile, "rb");
+    if (!stream){
+        return "";
+    }
+    unsigned char buf[65536];
+    unsigned long crc = crc32(0, 0, 0);
+    unsigned long adler = adler32(0, 0, 0);
+    long long total = 0;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream))){
+        crc = crc32(crc, buf, n);
+        adler = adler32(adler, buf, n);
+        total += n;
+    }
+    bool error = ferror(stream);
+    fclose(stream);
+    if (error){
+        return "";
+    }
+    char name[80];
+    snprintf(name, sizeof(name), "%08lx%08lx-%llx-%08lx", crc, adler, total, OptionsHash(Options));
+    *size = total;
+    std::string path = Options.Cache;
+    if (path.back() != '/'
+#ifdef _WIN32
+        && path.back() != '\\'
+#endif
+        ){
+        path += '/';
+    }
+    return path + name;
+}
+
+bool CacheLookup(const char * Infile, const ECTOptions& Options){
+    long long size;
+    std::string path = CachePath(Infile, Options, &size);
+    if (path.empty()){
+        return false;
+    }
+    FILE* stream = fopen(path.c_str(), "rb");
+    if (!stream){
+        return false;
+    }
+    long long recorded = -1;
+    if (fscanf(stream, "%lld", &recorded) != 1){
+        recorded = -1;
+    }
+    fclose(stream);
+    return recorded == size;
+}
+
+void CacheStore(const char * Infile, const ECTOptions& Options){
+    long long size;
+    std::string path = CachePath(Infile, Options, &size);
+    if (path.empty()){
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(Options.Cache, ec);
+    //Write to a temporary name first so that concurrent runs never see a partial record
+    std::string temp = path + "." + std::to_string(getpid()) + "." + std::to_string(tempcounter++) + ".tmp";
+    FILE* stream = fopen(temp.c_str(), "wb");
+    if (!stream){
+        return;
+    }
+    bool error = fprintf(stream, "%lld\n", size) < 0;
+    error |= fclose(stream) != 0;
+    if (error || rename(temp.c_str(), path.c_str())){
+        remove(temp.c_str());
+    }
+}
@@ -19,10 +19,13 @@
 
 #include "mozjpeg/jinclude.h"
 #include "mozjpeg/jpeglib.h"
+#include "mozjpeg/jerror.h"
 #include "mozjpeg/transupp.h"           /* Support routines for jpegtran */
 #include "main.h"
 #include "support.h"
 
+#include <setjmp.h>
+
 static size_t jcopy_markers_execute_s (j_decompress_ptr srcinfo, j_compress_ptr dstinfo)
 {
   size_t size = 0;
@@ -159,53 +162,106 @@ output_message (j_common_ptr cinfo)
   fprintf(stderr, "%s: %s\n", cinfo->err->addon_message_table[0], buffer);
 }
 
-int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorotate, const char * Infile, const char * Outfile, size_t* stripped_outsize)
+/* Error handler that returns control to mozjpegtranBuffer instead of exiting,
+ * so that a malformed JPEG doesn't take down a process using libect. */
+struct ect_error_mgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf* setjmp_buffer;
+};
+
+METHODDEF(void)
+error_exit (j_common_ptr cinfo)
+{
+  (*cinfo->err->output_message) (cinfo);
+  longjmp(*((ect_error_mgr*)cinfo->err)->setjmp_buffer, 1);
+}
+
+/* Memory destination owned by the caller. Unlike jpeg_mem_dest, the current
+ * buffer is always known, so it can be released after an error. */
+struct ect_destination_mgr {
+  struct jpeg_destination_mgr pub;
+  unsigned char* buffer;
+  size_t size;
+};
+
+METHODDEF(void)
+init_destination (j_compress_ptr cinfo)
+{
+  ect_destination_mgr* dest = (ect_destination_mgr*)cinfo->dest;
+  dest->size = 4096;
+  dest->buffer = (unsigned char*)malloc(dest->size);
+  if (!dest->buffer) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->size;
+}
+
+METHODDEF(boolean)
+empty_output_buffer (j_compress_ptr cinfo)
+{
+  ect_destination_mgr* dest = (ect_destination_mgr*)cinfo->dest;
+  /* On failure the old buffer stays in dest and is freed by mozjpegtranBuffer. */
+  unsigned char* buffer = (unsigned char*)realloc(dest->buffer, dest->size * 2);
+  if (!buffer) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+  dest->buffer = buffer;
+  dest->pub.next_output_byte = buffer + dest->size;
+  dest->pub.free_in_buffer = dest->size;
+  dest->size *= 2;
+  return TRUE;
+}
+
+METHODDEF(void)
+term_destination (j_compress_ptr cinfo)
+{
+  ect_destination_mgr* dest = (ect_destination_mgr*)cinfo->dest;
+  dest->size -= dest->pub.free_in_buffer;
+}
+
+/* Returns 0 on success, 1 if the input could not be transcoded. */
+int mozjpegtranBuffer (bool arithmetic, bool progressive, bool strip, unsigned autorotate, const unsigned char* inbuffer, size_t insize,
+                       unsigned char** outbuffer, unsigned long* outsize, size_t* stripped_outsize, const char * name)
 {
   struct jpeg_decompress_struct srcinfo;
   struct jpeg_compress_struct dstinfo;
-  struct jpeg_error_mgr jsrcerr, jdsterr;
+  struct ect_error_mgr jsrcerr, jdsterr;
+  struct ect_destination_mgr dest;
   jpeg_transform_info transformoption; /* image transformation options */
-  FILE * fp;
-  unsigned char *outbuffer = 0;
-  unsigned long outsize = 0;
   size_t extrasize = 0;
   unsigned char copy_exif = 0;
-  /* Initialize the JPEG decompression object with default error handling. */
-  srcinfo.err = jpeg_std_error(&jsrcerr);
+  jmp_buf setjmp_buffer;
+  *outbuffer = 0;
+  *outsize = 0;
+  dest.buffer = 0;
+  /* Initialize the JPEG decompression object with error handling that
+   * returns here. */
+  srcinfo.err = jpeg_std_error(&jsrcerr.pub);
   srcinfo.err->output_message = output_message;
-  const char* addon = Infile;
+  srcinfo.err->error_exit = error_exit;
+  jsrcerr.setjmp_buffer = &setjmp_buffer;
+  const char* addon = name;
   srcinfo.err->addon_message_table = &addon;
+  /* Initialize the JPEG compression object the same way. */
+  dstinfo.err = jpeg_std_error(&jdsterr.pub);
+  dstinfo.err->error_exit = error_exit;
+  jdsterr.setjmp_buffer = &setjmp_buffer;
+  srcinfo.mem = 0;
+  dstinfo.mem = 0;
+  if (setjmp(setjmp_buffer)) {
+    jpeg_destroy_compress(&dstinfo);
+    jpeg_destroy_decompress(&srcinfo);
+    free(dest.buffer);
+    return 1;
+  }
   jpeg_create_decompress(&srcinfo);
-  /* Initialize the JPEG compression object with default error handling. */
-  dstinfo.err = jpeg_std_error(&jdsterr);
   jpeg_create_compress(&dstinfo);
   if (!progressive){
     jpeg_c_set_int_param(&dstinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
   }
 
-  /* Open the input file. */
-  if (!(fp = fopen(Infile, "rb"))) {
-    fprintf(stderr, "ECT: can't open %s for reading\n", Infile);
-    return 2;
-  }
-
-  long long insize = filesize(Infile);
-  if(insize < 0){
-    fprintf(stderr, "ECT: can't read from %s\n", Infile);
-    return 2;
-  }
-  unsigned char* inbuffer = (unsigned char*)malloc(insize);
-  if (!inbuffer) {
-    fprintf(stderr, "ECT: memory allocation failure\n");
-    exit(1);
-  }
-
-  if (fread(inbuffer, 1, insize, fp) < (size_t)insize) {
-    fprintf(stderr, "ECT: can't read from %s\n", Infile);
-  }
-  fclose(fp);
-
-  jpeg_mem_src(&srcinfo, inbuffer, insize);
+  jpeg_mem_src(&srcinfo, (unsigned char*)inbuffer, insize);
 
   /* Enable saving of extra markers that we want to copy */
   if (!strip) {
@@ -240,7 +296,7 @@ int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorot
       transformoption.slow_hflip = FALSE;
       /* If perfect requested but not possible, show warning and do not transform */
       if (!jtransform_request_workspace(&srcinfo, &transformoption)) {
-        fprintf(stderr, "ECT: %s can't be transformed perfectly\n", Infile);
+        fprintf(stderr, "ECT: %s can't be transformed perfectly\n", name);
         transformoption.transform = JXFORM_NONE;
         copy_exif = 1;
       }
@@ -272,7 +328,10 @@ int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorot
   }
 
   /* Specify data destination for compression */
-  jpeg_mem_dest(&dstinfo, &outbuffer, &outsize);
+  dest.pub.init_destination = init_destination;
+  dest.pub.empty_output_buffer = empty_output_buffer;
+  dest.pub.term_destination = term_destination;
+  dstinfo.dest = &dest.pub;
 
   /* Start compressor (note no image data is actually written here) */
   jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
@@ -291,7 +350,50 @@ int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorot
 
   /* Finish compression and release memory */
   jpeg_finish_compress(&dstinfo);
+  jpeg_destroy_compress(&dstinfo);
+  jpeg_finish_decompress(&srcinfo);
+  jpeg_destroy_decompress(&srcinfo);
+  *outbuffer = dest.buffer;
+  *outsize = dest.size;
+  (*stripped_outsize) = *outsize - extrasize;
+  return 0;
+}
+
+int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorotate, const char * Infile, const char * Outfile, size_t* stripped_outsize)
+{
+  FILE * fp;
+  unsigned char *outbuffer = 0;
+  unsigned long outsize = 0;
+
+  /* Open the input file. */
+  if (!(fp = fopen(Infile, "rb"))) {
+    fprintf(stderr, "ECT: can't open %s for reading\n", Infile);
+    return 2;
+  }
+
+  long long insize = filesize(Infile);
+  if(insize < 0){
+    fprintf(stderr, "ECT: can't read from %s\n", Infile);
+    fclose(fp);
+    return 2;
+  }
+  unsigned char* inbuffer = (unsigned char*)malloc(insize);
+  if (!inbuffer) {
+    fprintf(stderr, "ECT: memory allocation failure\n");
+    fclose(fp);
+    return 2;
+  }
+
+  if (fread(inbuffer, 1, insize, fp) < (size_t)insize) {
+    fprintf(stderr, "ECT: can't read from %s\n", Infile);
+  }
+  fclose(fp);
+
+  int error = mozjpegtranBuffer(arithmetic, progressive, strip, autorotate, inbuffer, insize, &outbuffer, &outsize, stripped_outsize, Infile);
   free(inbuffer);
+  if (error) {
+    return 2;
+  }
 
   bool x = insize < outsize;
 
@@ -310,10 +412,6 @@ int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorot
     fclose(fp);
   }
 
-  jpeg_destroy_compress(&dstinfo);
-  jpeg_finish_decompress(&srcinfo);
-  jpeg_destroy_decompress(&srcinfo);
   free(outbuffer);
-  (*stripped_outsize) = /*x ? insize : */outsize - extrasize;
   return x;
 }
@@ -0,0 +1,161 @@
+//
+//  libect.cpp
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+
+#include "libect.h"
+#include "main.h"
+#include "threadpool.h"
+#include "zopfli/matchcache.h"
+#include "zopfli/zopfli.h"
+
+//Zopfli has no equivalent of level 1, which uses zlib or OptiPNG alone
+static unsigned ZopfliMode(unsigned mode){
+    return mode % 10000 < 2 ? mode - mode % 10000 + 2 : mode;
+}
+
+static ZopfliTuning ECTTuning(const ECTBufferOptions* options){
+    ZopfliTuning tuning;
+    ZopfliInitTuning(&tuning);
+    tuning.convergence = options->converge / 100;
+    tuning.optimalsplit = options->optimal_split ? ZOPFLI_OPTIMAL_SPLIT_CANDIDATES : 0;
+    return tuning;
+}
+
+static int ECTCopyResult(const unsigned char* data, size_t size, unsigned char** out, size_t* outsize){
+    *out = (unsigned char*)malloc(size);
+    if (!*out){
+        *outsize = 0;
+        return ECT_ERROR;
+    }
+    memcpy(*out, data, size);
+    *outsize = size;
+    return ECT_OK;
+}
+
+void ECTInitBufferOptions(ECTBufferOptions* options){
+    options->mode = 3;
+    options->multithreading = 0;
+    options->converge = 0;
+    options->optimal_split = 0;
+    options->strip = 0;
+    options->strict = 0;
+    options->allfilters = 0;
+    options->allfilters_top = 0;
+    options->progressive = 0;
+    options->autorotate = 0;
+    options->arithmetic = 0;
+}
+
+int ECTOptimizePNG(const ECTBufferOptions* options, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize){
+    *out = 0;
+    *outsize = 0;
+    if (!in || !insize){
+        return ECT_ERROR;
+    }
+    unsigned mode = options->mode % 10000 > 9 ? 9 : options->mode % 10000;
+    //OptiPNG works on files, so try both filter choices it would pick between instead
+    std::vector<int> filters;
+    if (options->allfilters){
+        filters = {6, 0, 5, 1, 2, 3, 4, 7, 8, 11, 12, 13};
+    }
+    else {
+        filters = {0, mode == 2 ? 8 : mode > 3 ? 11 : 5};
+    }
+
+    //The filter trials often produce the same scanlines for parts of the image
+    ZopfliTuning tuning = ECTTuning(options);
+    tuning.matchcache = 1;
+    ZopfliPNGSession* session = ZopfliPNGSessionOpenBuffer(std::vector<unsigned char>(in, in + insize), options->strip, options->strict,
+                                                           ZopfliMode(options->mode), options->multithreading, &tuning, 1, "PNG buffer");
+    if (!session){
+        return ECT_ERROR;
+    }
+    ThreadPoolInit(options->multithreading);
+    int result = ZopfliPNGSessionTryAll(session, filters.data(), filters.size(), options->allfilters ? options->allfilters_top : 0);
+    if (result < 0){
+        ZopfliPNGSessionFree(session);
+        ZopfliMatchCacheClear();
+        return ECT_ERROR;
+    }
+    if (result == ECT_OK){
+        const std::vector<unsigned char>& best = ZopfliPNGSessionBest(session);
+        result = ECTCopyResult(best.data(), best.size(), out, outsize);
+    }
+    ZopfliPNGSessionFree(session);
+    ZopfliMatchCacheClear();
+    return result;
+}
+
+int ECTOptimizeJPEG(const ECTBufferOptions* options, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize){
+    *out = 0;
+    *outsize = 0;
+    if (!in || !insize){
+        return ECT_ERROR;
+    }
+    unsigned char* result = 0;
+    unsigned long resultsize = 0;
+    size_t stsize = 0;
+    bool progressive = options->progressive && (options->mode > 1 || insize > 5000);
+    if (mozjpegtranBuffer(options->arithmetic, progressive, options->strip, options->autorotate, in, insize, &result, &resultsize, &stsize, "JPEG buffer")){
+        return ECT_ERROR;
+    }
+    //Same heuristic as for files: small progressive JPEGs are often larger than baseline ones
+    if (options->progressive && options->mode > 1){
+        if (resultsize > insize || (options->mode == 2 && stsize < 6500) || (options->mode == 3 && stsize < 10000) || (options->mode == 4 && stsize < 15000) || (options->mode > 4 && stsize < 20000)){
+            unsigned char* baseline = 0;
+            unsigned long baselinesize = 0;
+            //The input already decoded once, so a failure here leaves the first result in place
+            if (!mozjpegtranBuffer(options->arithmetic, false, options->strip, options->autorotate, in, insize, &baseline, &baselinesize, &stsize, "JPEG buffer")
+                && baselinesize < resultsize){
+                free(result);
+                result = baseline;
+                resultsize = baselinesize;
+            }
+            else {
+                free(baseline);
+            }
+        }
+    }
+    if (!result || resultsize >= insize){
+        free(result);
+        return ECT_NOT_SMALLER;
+    }
+    *out = result;
+    *outsize = resultsize;
+    return ECT_OK;
+}
+
+int ECTCompressGzip(const ECTBufferOptions* options, const unsigned char* in, size_t insize, const char* name, time_t mtime, unsigned char** out, size_t* outsize){
+    *out = 0;
+    *outsize = 0;
+    ZopfliTuning tuning = ECTTuning(options);
+    ZopfliGzipBuffer(ZopfliMode(options->mode), options->multithreading, &tuning, in, insize, mtime, name, out, outsize);
+    ZopfliMatchCacheClear();
+    return ECT_OK;
+}
+
+int ECTCompressZip(const ECTBufferOptions* options, const unsigned char* in, size_t insize, const char* name, time_t mtime, unsigned char** out, size_t* outsize){
+    *out = 0;
+    *outsize = 0;
+    ZopfliTuning tuning = ECTTuning(options);
+    ZopfliZipBuffer(ZopfliMode(options->mode), options->multithreading, &tuning, in, insize, mtime, name ? name : "data", out, outsize);
+    ZopfliMatchCacheClear();
+    return ECT_OK;
+}
+
+int ECTDeflate(const ECTBufferOptions* options, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize){
+    *out = 0;
+    *outsize = 0;
+    ZopfliTuning tuning = ECTTuning(options);
+    ZopfliBuffer(ZopfliMode(options->mode), options->multithreading, &tuning, in, insize, out, outsize);
+    ZopfliMatchCacheClear();
+    return ECT_OK;
+}
+
+void ECTFree(void* buffer){
+    free(buffer);
+}
@@ -0,0 +1,71 @@
+//
+//  libect.h
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+//  In-memory interface to ECT. All functions are thread-safe. On success, *out
+//  receives a buffer allocated with malloc that must be released with ECTFree.
+//
+//  Results don't depend on earlier calls, but two things persist between them:
+//  the thread pool, which grows to the largest thread count requested and is
+//  kept for the life of the process, and the Deflate match cache
+//  (zopfli/matchcache.h). The match cache is only filled by ECTOptimizePNG and
+//  is cleared at the end of every call. A caller that shares the process with
+//  other users of the Zopfli code can release its memory at any time with
+//  ZopfliMatchCacheClear.
+
+#ifndef __Efficient_Compression_Tool__libect__
+#define __Efficient_Compression_Tool__libect__
+
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ECTBufferOptions {
+  unsigned mode; /* Compression level as in -1 to -9, higher values set the number of iterations */
+  unsigned multithreading; /* Threads for per block multithreading in Deflate, 0 to disable */
+  double converge; /* Stop iterating on a Deflate block once it shrank by less than this many percent over 16 iterations, 0 to disable */
+  int optimal_split; /* Choose Deflate block boundaries with a dynamic-programming search */
+  int strip; /* Remove metadata */
+  int strict; /* Do not alter hidden colors of fully transparent PNG pixels */
+  int allfilters; /* Try all PNG filter strategies */
+  unsigned allfilters_top; /* With allfilters, only fully compress this many strategies ranked by a fast test, 0 for all */
+  int progressive; /* Use progressive encoding for JPEGs */
+  int autorotate; /* Rotate JPEGs: 0 never, 1 dropping non-transformable edges, 2 only if perfect */
+  int arithmetic; /* Use arithmetic coding for JPEGs */
+} ECTBufferOptions;
+
+/* Return values of the ECT* functions */
+#define ECT_OK 0 /* *out holds the result */
+#define ECT_NOT_SMALLER 1 /* The input could not be improved, *out is 0 */
+#define ECT_ERROR -1 /* The input is invalid, *out is 0 */
+
+void ECTInitBufferOptions(ECTBufferOptions* options);
+
+/* Losslessly recompresses a PNG file. */
+int ECTOptimizePNG(const ECTBufferOptions* options, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
+
+/* Losslessly recompresses a JPEG file. */
+int ECTOptimizeJPEG(const ECTBufferOptions* options, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
+
+/* Compresses data into a gzip file. name and mtime are stored in the header, name may be 0. */
+int ECTCompressGzip(const ECTBufferOptions* options, const unsigned char* in, size_t insize, const char* name, time_t mtime, unsigned char** out, size_t* outsize);
+
+/* Compresses data into a ZIP archive holding a single file called name. */
+int ECTCompressZip(const ECTBufferOptions* options, const unsigned char* in, size_t insize, const char* name, time_t mtime, unsigned char** out, size_t* outsize);
+
+/* Compresses data into a raw deflate stream. */
+int ECTDeflate(const ECTBufferOptions* options, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
+
+void ECTFree(void* buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined(__Efficient_Compression_Tool__libect__) */
@@ -4190,7 +4190,7 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static ColorTree ct;
+static thread_local ColorTree ct;
 static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                                const unsigned char* image, unsigned w, unsigned h,
                                LodePNGState* state, LodePNGPaletteSettings palset) {
@@ -4229,9 +4229,13 @@ static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   lodepng_info_copy(&info, &state->info_png);
   if(state->encoder.auto_convert) {
     LodePNGColorStats stats;
-    lodepng_color_stats_init(&stats);
-    state->error = lodepng_compute_color_stats(&stats, image, w, h, &state->info_raw);
-    if(state->error) goto cleanup;
+    if(state->encoder.color_stats) {
+      stats = *state->encoder.color_stats;
+    } else {
+      lodepng_color_stats_init(&stats);
+      state->error = lodepng_compute_color_stats(&stats, image, w, h, &state->info_raw);
+      if(state->error) goto cleanup;
+    }
     state->error = auto_choose_color(&info.color, &stats, state->div);
     if(state->error) goto cleanup;
     if(info.color.colortype == LCT_PALETTE && palset.order != LPOS_NONE) {
@@ -4383,6 +4387,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings) {
   settings->clean_alpha = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->color_stats = 0;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->text_compression = 1;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
@@ -521,6 +521,10 @@ typedef struct LodePNGEncoderSettings {
   unsigned short filter_style;
 
   unsigned quiet;
+
+  /*if not NULL and auto_convert is enabled, these precomputed stats of the raw image are used instead of
+  analyzing the image again. They must match the image and info_raw given to the encoder. Default: NULL*/
+  const LodePNGColorStats* color_stats;
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
@@ -6,8 +6,12 @@
 #include "main.h"
 #include "support.h"
 #include "gztools.h"
+#include "threadpool.h"
+#include "timing.h"
+#include "zopfli/zopfli.h"
 #include "miniz/miniz.h"
 #include <limits.h>
+#include <algorithm>
 #include <atomic>
 
 #ifndef NOMULTI
@@ -68,14 +72,31 @@ static void Usage() {
             " --disable-jpg     Disable JPEG optimization\n"
             " --strict          Enable strict losslessness\n"
             " --reuse           Keep PNG filter and colortype\n"
+            " --cache=dir       Remember optimized files in dir and skip them in later runs\n"
             " --allfilters      Try all PNG filter modes\n"
             " --allfilters-b    Try all PNG filter modes, including brute force strategies\n"
+            " --allfilters-top=i\n"
+            "                   Only fully compress the i filter modes that look best in a fast test\n"
             " --pal_sort=i      Try i different PNG palette filtering strategies (up to 120)\n"
 #ifndef NOMULTI
             " --mt-deflate      Use per block multithreading in Deflate\n"
             " --mt-deflate=i    Use per block multithreading in Deflate with i threads\n"
             " --mt-file         Use per file multithreading\n"
             " --mt-file=i       Use per file multithreading with i threads\n"
+            " --mt-file-sort    Process files with the highest estimated cost first\n"
+            " --mt-file-pack=i  Process files smaller than i KiB in batches of i KiB\n"
+            " --speculate       With --mt-deflate, try extra Deflate cost models on idle threads. Not always smaller\n"
+#endif
+            " --time-budget=s   Stop improving a file after s seconds and keep the best result so far\n"
+            " --time-budget-total=s\n"
+            "                   Same for all files together\n"
+            " --converge=p      Stop iterating on a Deflate block once it shrank by less than p percent over 16 iterations\n"
+            " --optimal-split   Choose Deflate block boundaries with a dynamic-programming search before splitting further\n"
+            " --timing=file     Write the time spent in each stage of each file to file as JSON lines, or CSV if it ends in .csv\n"
+            " --serve           Optimize files named on stdin, one job per line, reporting JSON results\n"
+            "                   Jobs run one at a time, or concurrently with --mt-file\n"
+#ifndef _WIN32
+            " --serve=path      Accept jobs on the Unix domain socket at path\n"
 #endif
             //" --arithmetic   Use arithmetic encoding for JPEGs, incompatible with most software\n"
 #ifdef __DATE__
@@ -121,7 +142,7 @@ static void ECT_ReportSavings(){
     else {printf("No compatible files found\n");}
 }
 
-static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multithreading, long long fs, unsigned ZIP, int strict){
+static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multithreading, const ZopfliTuning* tuning, long long fs, unsigned ZIP, int strict){
     if (!fs){
       printf("%s: Compression of empty files is currently not supported\n", Infile);
       return 2;
@@ -149,11 +170,11 @@ static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multi
         fprintf(stderr, "%s: Compressed file already exists\n", Infile);
         return 2;
       }
-      if (ZopfliGzip(Infile, out_name, Mode, multithreading, ZIP, 0, Infile)) {return 2;}
+      if (ZopfliGzip(Infile, out_name, Mode, multithreading, tuning, ZIP, 0, Infile)) {return 2;}
       return 1;
     }
     else {
-      if (exists(out_name) || ZopfliGzip(Infile, out_name, Mode, multithreading, ZIP, 1, gzip_name)) {
+      if (exists(out_name) || ZopfliGzip(Infile, out_name, Mode, multithreading, tuning, ZIP, 1, gzip_name)) {
         if (gzip_name) {
           free(gzip_name);
         }
@@ -172,6 +193,15 @@ static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multi
     }
 }
 
+//Runs OptiPNG with an entry in the timing report
+static int OptipngTimed(unsigned level, const char * Infile, bool force_no_palette, unsigned clean_alpha){
+    double timing = TimingStart();
+    long long size = timing ? filesize(Infile) : 0;
+    int filter = Optipng(level, Infile, force_no_palette, clean_alpha);
+    TimingStage("optipng", timing, size, timing ? filesize(Infile) : 0);
+    return filter;
+}
+
 static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options){
     unsigned _mode = Options.Mode;
     unsigned mode = (Options.Mode % 10000) > 9 ? 9 : (Options.Mode % 10000);
@@ -187,7 +217,7 @@ static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options)
         return 1;
     }
     if(mode == 9 && !Options.Reuse && !Options.Allfilters){
-        x = Zopflipng(Options.strip, Infile, Options.Strict, 3, 0, Options.DeflateMultithreading, quiet);
+        x = Zopflipng(Options.strip, Infile, Options.Strict, 3, 0, Options.DeflateMultithreading, &Options.Tuning, quiet);
         if(x < 0){
             return 1;
         }
@@ -196,7 +226,7 @@ static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options)
     //int filter = Optipng(Options.Mode, Infile, true, Options.Strict || Options.Mode > 1);
     int filter = 0;
     if (!Options.Allfilters){
-        filter = Options.Reuse ? 6 : Optipng(mode, Infile, false, Options.Strict || mode > 1);
+        filter = Options.Reuse ? 6 : OptipngTimed(mode, Infile, false, Options.Strict || mode > 1);
     }
 
     if (filter == -1){
@@ -207,32 +237,35 @@ static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options)
     }
     if (mode != 1){
         if (Options.Allfilters){
-            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, 6 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            if(x < 0){
+            //Decode once and only write the smallest result. Filter strategies often produce the same scanlines for
+            //parts of the image, so the trials share their match lists.
+            ZopfliTuning tuning = Options.Tuning;
+            tuning.matchcache = 1;
+            ZopfliPNGSession* session = ZopfliPNGSessionOpen(Infile, Options.strip, Options.Strict, _mode, Options.DeflateMultithreading, &tuning, quiet);
+            if(!session){
                 return 1;
             }
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 5 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 1 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 2 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 3 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 4 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 7 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 8 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 11 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 12 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 13 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-            if (Options.Allfiltersbrute){
-                Zopflipng(Options.strip, Infile, Options.Strict, _mode, 9 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-                Zopflipng(Options.strip, Infile, Options.Strict, _mode, 10 + Options.palette_sort, Options.DeflateMultithreading, quiet);
-                Zopflipng(Options.strip, Infile, Options.Strict, _mode, 14 + Options.palette_sort, Options.DeflateMultithreading, quiet);
+            static const int strategies[] = {6, 0, 5, 1, 2, 3, 4, 7, 8, 11, 12, 13, 9, 10, 14};
+            int filters[15];
+            unsigned trials = Options.Allfiltersbrute ? 15 : 12;
+            for (unsigned i = 0; i < trials; i++){
+                filters[i] = strategies[i] + Options.palette_sort;
+            }
+            //The trials are independent and run concurrently on the thread pool
+            if(ZopfliPNGSessionTryAll(session, filters, trials, Options.AllfiltersTop) < 0){
+                ZopfliPNGSessionFree(session);
+                return 1;
+            }
+            x = ZopfliPNGSessionClose(session);
+            if(x < 0){
+                return 1;
             }
         }
         else if (mode == 9){
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, quiet);
+            Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, &Options.Tuning, quiet);
         }
         else {
-            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, quiet);
+            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, &Options.Tuning, quiet);
             if(x < 0){
                 return 1;
             }
@@ -240,7 +273,7 @@ static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options)
     }
 
     if(Options.strip && x){
-        Optipng(0, Infile, false, 0);
+        OptipngTimed(0, Infile, false, 0);
     }
     return 0;
 }
@@ -308,16 +341,30 @@ unsigned fileHandler(const char * Infile, const ECTOptions& Options, int interna
             return 1;
         }
         int statcompressedfile = 0;
+        bool cache = !Options.Cache.empty() && !(Options.Gzip && !internal);
+        if (cache && CacheLookup(Infile, Options)){
+            if(Options.SavingsCounter && !internal){
+                processedfiles.fetch_add(1);
+                bytes.fetch_add(size);
+            }
+            return 0;
+        }
+        void* timingcontext = TimingFileBegin(Infile, Options.TimeBudget);
         if (size < 1200000000) {//completely random value
             if (Options.Gzip && !internal) {
-                statcompressedfile = ECTGzip(Infile, Options.Mode, Options.DeflateMultithreading, size, Options.Zip, Options.Strict);
+                double timing = TimingStart();
+                statcompressedfile = ECTGzip(Infile, Options.Mode, Options.DeflateMultithreading, &Options.Tuning, size, Options.Zip, Options.Strict);
+                TimingStage("gzip", timing, size, 0);
                 if (statcompressedfile == 2){
+                    TimingFileEnd(timingcontext, size, size);
                     return 1;
                 }
             } else if (x == "PNG" || x == "png") {
                 error = OptimizePNG(Infile, Options);
             } else if (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg") {
+                double timing = TimingStart();
                 error = OptimizeJPEG(Infile, Options);
+                TimingStage("jpegtran", timing, size, filesize(Infile));
             }
             if(Options.SavingsCounter && !internal){
                 processedfiles.fetch_add(1);
@@ -334,6 +381,12 @@ unsigned fileHandler(const char * Infile, const ECTOptions& Options, int interna
         if(Options.keep && !statcompressedfile){
             set_file_time(Infile, t);
         }
+        //A file cut short by the time budget could still improve, so it must not be skipped in later runs
+        bool budgetexpired = TimingDeadlineExpired();
+        TimingFileEnd(timingcontext, size, filesize(statcompressedfile ? ((std::string)Infile).append(Options.Zip ? ".zip" : ".gz").c_str() : Infile));
+        if(cache && !error && !budgetexpired && size < 1200000000){
+            CacheStore(Infile, Options);
+        }
     }
 #ifdef MP3_SUPPORTED
     else if(x == "mp3"){
@@ -343,6 +396,82 @@ unsigned fileHandler(const char * Infile, const ECTOptions& Options, int interna
     return error;
 }
 
+#ifndef NOMULTI
+//Rough estimate of the time needed to optimize a file, used to dispatch the most expensive files first
+static double EstimateFileCost(const std::string& file, const ECTOptions& Options, long long size){
+    std::string x = file.substr(file.find_last_of(".") + 1);
+    if (!Options.Gzip && (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg")){
+        //Transcoding does not depend on the compression level
+        return size;
+    }
+    //Number of squeeze iterations per mode, see ZopfliInitOptions
+    static const unsigned iterations[10] = {1, 1, 1, 1, 2, 3, 8, 13, 40, 60};
+    unsigned mode = Options.Mode % 10000;
+    double factor = (mode > 9 ? mode : iterations[mode]) * (Options.Mode / 10000 + 1);
+    double work = size;
+    if (!Options.Gzip && (x == "PNG" || x == "png")){
+        //Deflate runs on the filtered image data, which may be much larger than the file
+        unsigned char ihdr[26];
+        FILE* stream = fopen(file.c_str(), "rb");
+        if (stream){
+            if (fread(ihdr, 1, 26, stream) == 26 && memcmp(ihdr + 12, "IHDR", 4) == 0){
+                unsigned long long w = ((unsigned)ihdr[16] << 24) | (ihdr[17] << 16) | (ihdr[18] << 8) | ihdr[19];
+                unsigned long long h = ((unsigned)ihdr[20] << 24) | (ihdr[21] << 16) | (ihdr[22] << 8) | ihdr[23];
+                unsigned channels = ihdr[25] == 2 ? 3 : ihdr[25] == 4 ? 2 : ihdr[25] == 6 ? 4 : 1;
+                work = h * (1 + (w * channels * ihdr[24] + 7) / 8);
+            }
+            fclose(stream);
+        }
+        if (Options.Allfilters){
+            factor *= Options.Allfiltersbrute ? 15 : 12;
+        }
+    }
+    return work * factor;
+}
+
+//Groups files into tasks for per file multithreading. Tasks are ordered by estimated cost if requested, small files are batched.
+static std::vector<std::vector<std::string>> ScheduleFiles(const std::vector<std::string>& fileList, const ECTOptions& Options){
+    std::vector<std::pair<double, std::vector<std::string>>> tasks;
+    std::vector<std::string> batch;
+    long long batchsize = 0;
+    long long packsize = (long long)Options.PackSmall * 1024;
+    for (const auto& file : fileList){
+        long long size = filesize(file.c_str());
+        if (size >= 0 && size < packsize){
+            batch.push_back(file);
+            batchsize += size;
+            if (batchsize >= packsize){
+                tasks.emplace_back(0, std::move(batch));
+                batch.clear();
+                batchsize = 0;
+            }
+            continue;
+        }
+        tasks.emplace_back(0, std::vector<std::string>(1, file));
+    }
+    if (!batch.empty()){
+        tasks.emplace_back(0, std::move(batch));
+    }
+
+    if (Options.SizeOrder){
+        for (auto& task : tasks){
+            for (const auto& file : task.second){
+                long long size = filesize(file.c_str());
+                task.first += size > 0 ? EstimateFileCost(file, Options, size) : 0;
+            }
+        }
+        std::stable_sort(tasks.begin(), tasks.end(), [](const std::pair<double, std::vector<std::string>>& a, const std::pair<double, std::vector<std::string>>& b){
+            return a.first > b.first;
+        });
+    }
+    std::vector<std::vector<std::string>> result;
+    for (auto& task : tasks){
+        result.push_back(std::move(task.second));
+    }
+    return result;
+}
+#endif
+
 unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const ECTOptions& Options){
     std::string extension = ((std::string)argv[args[0]]).substr(((std::string)argv[args[0]]).find_last_of(".") + 1);
     std::string zipfilename = argv[args[0]];
@@ -510,15 +639,70 @@ unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const
     return error;
 }
 
-static void multithreadFileLoop(const std::vector<std::string> &fileList, std::atomic<size_t> *pos, const ECTOptions &options, std::atomic<unsigned> *error) {
-    while (true) {
-        size_t nextPos = pos->fetch_add(1);
-        if (nextPos >= fileList.size()) {
-            break;
+//Applies a single command line flag to Options. Returns false if the flag is unknown.
+bool ParseOption(const char * arg, ECTOptions& Options){
+    int strlen = strnlen(arg, 64);
+    if (strncmp(arg, "-strip", strlen) == 0){Options.strip = true;}
+    else if (strncmp(arg, "-progressive", strlen) == 0) {Options.Progressive = true;}
+    else if (strncmp(arg, "-autorotate", strlen) == 0) {Options.Autorotate = 2;} //Transform only if 'perfect'
+    else if (strncmp(arg, "-autorotate=force", strlen) == 0) {Options.Autorotate = 1;} //Always transform
+    else if (arg[0] == '-' && isdigit(arg[1])) {
+        int l = atoi(arg + 1);
+        if (!l) {
+            l = 1;
         }
-        unsigned localError = fileHandler(fileList[nextPos].c_str(), options, 0);
-        error->fetch_or(localError);
+        Options.Mode = l;
     }
+    else if (strncmp(arg, "-gzip", strlen) == 0) {Options.Gzip = true;}
+    else if (strncmp(arg, "-zip", strlen) == 0) {Options.Zip = true; Options.Gzip = true;}
+    else if (strncmp(arg, "-quiet", strlen) == 0) {Options.SavingsCounter = false;}
+    else if (strncmp(arg, "-keep", strlen) == 0) {Options.keep = true;}
+    else if (strcmp(arg, "--disable-jpeg") == 0 || strcmp(arg, "--disable-jpg") == 0 ){Options.JPEG_ACTIVE = false;}
+    else if (strcmp(arg, "--disable-png") == 0){Options.PNG_ACTIVE = false;}
+#ifdef FS_SUPPORTED
+    else if (strncmp(arg, "-recurse", strlen) == 0)  {Options.Recurse = 1;}
+#endif
+    else if (strcmp(arg, "--strict") == 0) {Options.Strict = true;}
+    else if (strcmp(arg, "--reuse") == 0) {Options.Reuse = true;}
+    else if (strncmp(arg, "--cache=", 8) == 0 && arg[8]) {Options.Cache = arg + 8;}
+    else if (strncmp(arg, "--time-budget=", 14) == 0) {Options.TimeBudget = atof(arg + 14);}
+    else if (strcmp(arg, "--optimal-split") == 0) {Options.Tuning.optimalsplit = ZOPFLI_OPTIMAL_SPLIT_CANDIDATES;}
+    else if (strcmp(arg, "--speculate") == 0) {Options.Tuning.speculate = 1;}
+    else if (strcmp(arg, "--allfilters") == 0) {Options.Allfilters = true;}
+    else if (strcmp(arg, "--allfilters-b") == 0) {Options.Allfiltersbrute = Options.Allfilters = true;}
+    else if (strcmp(arg, "--allfilters-c") == 0) {Options.Allfilterscheap = true;}
+    else if (strncmp(arg, "--allfilters-top=", 17) == 0) {Options.AllfiltersTop = atoi(arg + 17);}
+    else if (strncmp(arg, "--pal_sort=", 11) == 0){
+        Options.palette_sort = atoi(arg + 11) << 8;
+        if(Options.palette_sort > 120 << 8){
+            Options.palette_sort = 120 << 8;
+        }
+    }
+
+
+#ifndef NOMULTI
+    else if (strcmp(arg, "--mt-file-sort") == 0) {Options.SizeOrder = true;}
+    else if (strncmp(arg, "--mt-file-pack=", 15) == 0) {Options.PackSmall = atoi(arg + 15);}
+    else if (strncmp(arg, "--mt-deflate", 12) == 0) {
+        if (strncmp(arg, "--mt-deflate=", 13) == 0){
+            Options.DeflateMultithreading = atoi(arg + 13);
+        }
+        else if (strcmp(arg, "--mt-deflate") == 0) {
+            Options.DeflateMultithreading = std::thread::hardware_concurrency();
+        }
+    }
+    else if (strncmp(arg, "--mt-file", 9) == 0) {
+        if (strncmp(arg, "--mt-file=", 10) == 0){
+            Options.FileMultithreading = atoi(arg + 10);
+        }
+        else if (strcmp(arg, "--mt-file") == 0) {
+            Options.FileMultithreading = std::thread::hardware_concurrency();
+        }
+    }
+#endif
+    else if (strcmp(arg, "--arithmetic") == 0) {Options.Arithmetic = true;}
+    else {return false;}
+    return true;
 }
 
 int main(int argc, const char * argv[]) {
@@ -540,14 +724,20 @@ int main(int argc, const char * argv[]) {
     Options.Strict = false;
     Options.DeflateMultithreading = 0;
     Options.FileMultithreading = 0;
+    Options.SizeOrder = false;
+    Options.PackSmall = 0;
     Options.Reuse = 0;
     Options.Allfilters = 0;
     Options.Allfiltersbrute = 0;
     Options.Allfilterscheap = 0;
+    Options.AllfiltersTop = 0;
+    Options.TimeBudget = 0;
+    ZopfliInitTuning(&Options.Tuning);
     Options.palette_sort = 0;
     Options.keep = false;
     std::vector<int> args;
     int files = 0;
+    const char* serve = 0;
     if (argc >= 2){
         for (int i = 1; i < argc; i++) {
             int strlen = strnlen(argv[i], 64);  //File names may be longer and are unaffected by this check
@@ -555,59 +745,19 @@ int main(int argc, const char * argv[]) {
                 args.push_back(i);
                 files++;
             }
-            else if (strncmp(argv[i], "-strip", strlen) == 0){Options.strip = true;}
-            else if (strncmp(argv[i], "-progressive", strlen) == 0) {Options.Progressive = true;}
-            else if (strncmp(argv[i], "-autorotate", strlen) == 0) {Options.Autorotate = 2;} //Transform only if 'perfect'
-            else if (strncmp(argv[i], "-autorotate=force", strlen) == 0) {Options.Autorotate = 1;} //Always transform
-            else if (argv[i][0] == '-' && isdigit(argv[i][1])) {
-                int l = atoi(argv[i] + 1);
-                if (!l) {
-                    l = 1;
-                }
-                Options.Mode = l;
-            }
-            else if (strncmp(argv[i], "-gzip", strlen) == 0) {Options.Gzip = true;}
-            else if (strncmp(argv[i], "-zip", strlen) == 0) {Options.Zip = true; Options.Gzip = true;}
+            else if (ParseOption(argv[i], Options)) {}
             else if (strncmp(argv[i], "-help", strlen) == 0) {Usage(); return 0;}
-            else if (strncmp(argv[i], "-quiet", strlen) == 0) {Options.SavingsCounter = false;}
-            else if (strncmp(argv[i], "-keep", strlen) == 0) {Options.keep = true;}
-            else if (strcmp(argv[i], "--disable-jpeg") == 0 || strcmp(argv[i], "--disable-jpg") == 0 ){Options.JPEG_ACTIVE = false;}
-            else if (strcmp(argv[i], "--disable-png") == 0){Options.PNG_ACTIVE = false;}
-#ifdef FS_SUPPORTED
-            else if (strncmp(argv[i], "-recurse", strlen) == 0)  {Options.Recurse = 1;}
-#endif
-            else if (strcmp(argv[i], "--strict") == 0) {Options.Strict = true;}
-            else if (strcmp(argv[i], "--reuse") == 0) {Options.Reuse = true;}
-            else if (strcmp(argv[i], "--allfilters") == 0) {Options.Allfilters = true;}
-            else if (strcmp(argv[i], "--allfilters-b") == 0) {Options.Allfiltersbrute = Options.Allfilters = true;}
-            else if (strcmp(argv[i], "--allfilters-c") == 0) {Options.Allfilterscheap = true;}
-            else if (strncmp(argv[i], "--pal_sort=", 11) == 0){
-                Options.palette_sort = atoi(argv[i] + 11) << 8;
-                if(Options.palette_sort > 120 << 8){
-                    Options.palette_sort = 120 << 8;
-                }
+            else if (strncmp(argv[i], "--serve", 7) == 0 && (argv[i][7] == '=' || !argv[i][7])) {serve = argv[i][7] ? argv[i] + 8 : "";}
+            else if (strncmp(argv[i], "--time-budget-total=", 20) == 0) {TimingSetTotalBudget(atof(argv[i] + 20));}
+            else if (strncmp(argv[i], "--converge=", 11) == 0) {
+                Options.Tuning.convergence = atof(argv[i] + 11) / 100;
             }
-
-
-#ifndef NOMULTI
-            else if (strncmp(argv[i], "--mt-deflate", 12) == 0) {
-                if (strncmp(argv[i], "--mt-deflate=", 13) == 0){
-                    Options.DeflateMultithreading = atoi(argv[i] + 13);
-                }
-                else if (strcmp(argv[i], "--mt-deflate") == 0) {
-                    Options.DeflateMultithreading = std::thread::hardware_concurrency();
-                }
-            }
-            else if (strncmp(argv[i], "--mt-file", 9) == 0) {
-                if (strncmp(argv[i], "--mt-file=", 10) == 0){
-                    Options.FileMultithreading = atoi(argv[i] + 10);
-                }
-                else if (strcmp(argv[i], "--mt-file") == 0) {
-                    Options.FileMultithreading = std::thread::hardware_concurrency();
+            else if (strncmp(argv[i], "--timing=", 9) == 0 && argv[i][9]) {
+                if (!TimingOpen(argv[i] + 9)){
+                    printf("Can't write timing report to %s\n", argv[i] + 9);
+                    return 1;
                 }
             }
-#endif
-            else if (strcmp(argv[i], "--arithmetic") == 0) {Options.Arithmetic = true;}
             else {printf("Unknown flag: %s\n", argv[i]); return 0;}
         }
         if(Options.Autorotate > 0) {
@@ -616,6 +766,9 @@ int main(int argc, const char * argv[]) {
         if(Options.Reuse){
             Options.Allfilters = 0;
         }
+        if(serve){
+            return ServeJobs(Options, serve);
+        }
         if(Options.Zip && files){
             error |= zipHandler(args, argv, files, Options);
         }
@@ -649,15 +802,18 @@ int main(int argc, const char * argv[]) {
 #endif
             }
 #ifndef NOMULTI
+            //File and deflate workers share one pool, sized by the larger of the two settings
+            ThreadPoolInit(std::max(Options.FileMultithreading, Options.DeflateMultithreading));
             if (Options.FileMultithreading) {
-                std::vector<std::thread> threads;
-                std::atomic<size_t> pos(0);
-                for (unsigned i = 0; i < Options.FileMultithreading; i++) {
-                    threads.emplace_back(multithreadFileLoop, fileList, &pos, Options, &error);
-                }
-                for (auto &thread : threads) {
-                    thread.join();
+                TaskGroup group;
+                for (auto& task : ScheduleFiles(fileList, Options)) {
+                    group.Run([task, &Options, &error]{
+                        for (const auto& file : task) {
+                            error |= fileHandler(file.c_str(), Options, 0);
+                        }
+                    });
                 }
+                group.Wait();
             }
             else {
                 for (const auto& file : fileList) {
@@ -9,9 +9,12 @@
 #include <cstdlib>
 #include <string>
 #include <cstring>
+#include <ctime>
 #include <cstdint>
 #include <vector>
 
+#include "zopfli/zopfli.h"
+
 //Compile support for folder input. Requires std::filesystem introduced in C++17.
 // TODO(cleanup): This is now supported unconditionally, we can clean up the define.
 #define FS_SUPPORTED
@@ -34,19 +37,44 @@ struct ECTOptions{
   bool Allfilters;
   bool Allfiltersbrute;
   bool Allfilterscheap;
+  unsigned AllfiltersTop;
 #ifdef FS_SUPPORTED
   bool Recurse;
 #endif
   unsigned DeflateMultithreading;
   unsigned FileMultithreading;
+  bool SizeOrder;
+  unsigned PackSmall;
+  std::string Cache;
+  double TimeBudget;
+  ZopfliTuning Tuning;
   bool keep;
 };
 
 int Optipng(unsigned level, const char * Infile, bool force_no_palette, unsigned clean_alpha);
-int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned quiet);
+int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, const ZopfliTuning* tuning, unsigned quiet);
+int ZopflipngBuffer(bool strip, const std::vector<unsigned char>& origpng, bool strict, unsigned Mode, int filter, unsigned multithreading, const ZopfliTuning* tuning, unsigned quiet,
+                    std::vector<unsigned char>& resultpng, const char * name);
+struct ZopfliPNGSession;
+ZopfliPNGSession* ZopfliPNGSessionOpen(const char * Infile, bool strip, bool strict, unsigned Mode, unsigned multithreading, const ZopfliTuning* tuning, unsigned quiet);
+ZopfliPNGSession* ZopfliPNGSessionOpenBuffer(const std::vector<unsigned char>& origpng, bool strip, bool strict, unsigned Mode, unsigned multithreading, const ZopfliTuning* tuning,
+                                             unsigned quiet, const char * name);
+int ZopfliPNGSessionTry(ZopfliPNGSession* session, int filter);
+int ZopfliPNGSessionTryAll(ZopfliPNGSession* session, const int* filters, unsigned n, unsigned top);
+const std::vector<unsigned char>& ZopfliPNGSessionBest(const ZopfliPNGSession* session);
+int ZopfliPNGSessionClose(ZopfliPNGSession* session);
+void ZopfliPNGSessionFree(ZopfliPNGSession* session);
 int mozjpegtran (bool arithmetic, bool progressive, bool strip, unsigned autorotate, const char * Infile, const char * Outfile, size_t* stripped_outsize);
-int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, unsigned ZIP, unsigned char isGZ, const char* gzip_name);
-void ZopfliBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
+int mozjpegtranBuffer (bool arithmetic, bool progressive, bool strip, unsigned autorotate, const unsigned char* inbuffer, size_t insize,
+                       unsigned char** outbuffer, unsigned long* outsize, size_t* stripped_outsize, const char * name);
+int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, unsigned ZIP, unsigned char isGZ, const char* gzip_name);
+void ZopfliGzipBuffer(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, const unsigned char* in, size_t insize, time_t time, const char* name, unsigned char** out, size_t* outsize);
+void ZopfliZipBuffer(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, const unsigned char* in, size_t insize, time_t time, const char* name, unsigned char** out, size_t* outsize);
+void ZopfliBuffer(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
 unsigned fileHandler(const char * Infile, const ECTOptions& Options, int internal);
+bool ParseOption(const char * arg, ECTOptions& Options);
+int ServeJobs(const ECTOptions& Options, const char * socketpath);
+bool CacheLookup(const char * Infile, const ECTOptions& Options);
+void CacheStore(const char * Infile, const ECTOptions& Options);
 unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const ECTOptions& Options);
 void ReZipFile(const char* file_path, const ECTOptions& Options, size_t* files);
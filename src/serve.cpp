@@ -0,0 +1,255 @@
+//
+//  serve.cpp
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+//  Batch server mode. Each job is one line of flags followed by a file name,
+//  e.g. "-9 --strict images/a.png". Flags are applied on top of the options
+//  the server was started with. Every finished job is reported as one line of
+//  JSON. Jobs run on the shared thread pool, which stays warm between jobs.
+//  The jobs of a connection run one at a time unless the server was started
+//  with --mt-file. On stdin, the results are the only output on stdout; all
+//  other messages go to stderr.
+
+#include "main.h"
+#include "support.h"
+#include "threadpool.h"
+#include "timing.h"
+#include "zopfli/matchcache.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#ifndef NOMULTI
+#include <mutex>
+#include <thread>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+//Destination for job results: a stream or a socket
+struct ServeConnection {
+  FILE* in;
+  FILE* out;
+  int fd;
+  unsigned long long jobs;
+#ifndef NOMULTI
+  std::mutex mtx;
+#endif
+};
+
+static void ServeReply(ServeConnection* conn, const std::string& line){
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(conn->mtx);
+#endif
+#ifndef _WIN32
+    if (conn->fd >= 0){
+        size_t done = 0;
+        while (done < line.size()){
+            ssize_t w = write(conn->fd, line.data() + done, line.size() - done);
+            if (w <= 0){
+                return;
+            }
+            done += w;
+        }
+        return;
+    }
+#endif
+    fwrite(line.data(), 1, line.size(), conn->out);
+    fflush(conn->out);
+}
+
+static bool ReadLine(FILE* stream, std::string& line){
+    line.clear();
+    int c;
+    while ((c = getc(stream)) != EOF){
+        if (c == '\n'){
+            break;
+        }
+        line += (char)c;
+    }
+    if (!line.empty() && line.back() == '\r'){
+        line.pop_back();
+    }
+    return c != EOF || !line.empty();
+}
+
+//Jobs currently being optimized
+static std::atomic<unsigned> running(0);
+
+static std::string ServeJob(const std::string& line, const ECTOptions& defaults, unsigned long long id){
+    ECTOptions Options = defaults;
+    std::string error;
+    size_t pos = 0;
+    for (;;){
+        while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t')){
+            pos++;
+        }
+        if (pos >= line.size() || line[pos] != '-'){
+            break;
+        }
+        size_t end = line.find_first_of(" \t", pos);
+        if (end == std::string::npos){
+            end = line.size();
+        }
+        std::string flag = line.substr(pos, end - pos);
+        if (!ParseOption(flag.c_str(), Options)){
+            error = "Unknown flag: " + flag;
+        }
+        pos = end;
+    }
+    std::string file = line.substr(pos);
+    if(Options.Reuse){
+        Options.Allfilters = 0;
+    }
+    //Output goes to the client, never to stdout
+    Options.SavingsCounter = false;
+    //Clients often send the same data again, e.g. one image under several names
+    Options.Tuning.matchcache = 1;
+
+    long long size = filesize(file.c_str());
+    long long result = -1;
+    double seconds = 0;
+    if (error.empty()){
+        if (file.empty() || size < 0 || isDirectory(file.c_str())){
+            error = "bad file";
+        }
+        else if (Options.Zip){
+            error = "-zip is not supported in server mode";
+        }
+        else if (Options.Autorotate > 0 && !Options.strip){
+            error = "Flag -autorotate requires -strip";
+        }
+    }
+    if (error.empty()){
+        auto start = std::chrono::steady_clock::now();
+        running++;
+        if (fileHandler(file.c_str(), Options, 0)){
+            error = "optimization failed";
+        }
+        //A server runs for long, so only jobs that run at the same time share match lists
+        if (!--running){
+            ZopfliMatchCacheClear();
+        }
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result = Options.Gzip ? filesize((file + ".gz").c_str()) : filesize(file.c_str());
+    }
+
+    char numbers[128];
+    std::string json = "{\"id\":" + std::to_string(id) + ",\"file\":" + TimingJSONString(file);
+    if (!error.empty()){
+        return json + ",\"status\":\"error\",\"error\":" + TimingJSONString(error) + "}\n";
+    }
+    snprintf(numbers, sizeof(numbers), ",\"status\":\"ok\",\"original\":%lld,\"optimized\":%lld,\"seconds\":%.3f}\n", size, result, seconds);
+    return json + numbers;
+}
+
+//Reads jobs until the end of the stream and waits for all of them to finish
+static void ServeConnectionLoop(ServeConnection* conn, const ECTOptions& Options){
+    TaskGroup group;
+    std::string line;
+    while (ReadLine(conn->in, line)){
+        if (line.find_first_not_of(" \t") == std::string::npos){
+            continue;
+        }
+        unsigned long long id = conn->jobs++;
+        if (Options.FileMultithreading){
+            group.Run([conn, line, &Options, id]{ServeReply(conn, ServeJob(line, Options, id));});
+        }
+        else {
+            ServeReply(conn, ServeJob(line, Options, id));
+        }
+    }
+    group.Wait();
+}
+
+int ServeJobs(const ECTOptions& Options, const char * socketpath){
+    ThreadPoolInit(std::max(Options.FileMultithreading, Options.DeflateMultithreading));
+    if (!*socketpath){
+        //Results keep the original stdout to themselves. Everything else the optimizers print goes to stderr, so it
+        //can't end up in the middle of the JSON lines.
+        fflush(stdout);
+        int replies = dup(fileno(stdout));
+        ServeConnection conn;
+        conn.in = stdin;
+        conn.out = replies < 0 ? 0 : fdopen(replies, "w");
+        conn.fd = -1;
+        conn.jobs = 0;
+        if (!conn.out || dup2(fileno(stderr), fileno(stdout)) < 0){
+            fprintf(stderr, "Can't redirect stdout\n");
+            return 1;
+        }
+        ServeConnectionLoop(&conn, Options);
+        fclose(conn.out);
+        return 0;
+    }
+#ifdef _WIN32
+    printf("Unix domain sockets are not supported on this platform\n");
+    return 1;
+#else
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketpath) >= sizeof(addr.sun_path)){
+        printf("Socket path too long: %s\n", socketpath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketpath);
+    //A client that disconnects early must not terminate the server
+    signal(SIGPIPE, SIG_IGN);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0){
+        printf("Can't create socket\n");
+        return 1;
+    }
+    //Only replace a socket left over from an earlier server, never another kind of file
+    struct stat st;
+    if (!lstat(socketpath, &st)){
+        if (!S_ISSOCK(st.st_mode)){
+            printf("%s exists and is not a socket\n", socketpath);
+            close(server);
+            return 1;
+        }
+        unlink(socketpath);
+    }
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) || listen(server, 16)){
+        printf("Can't listen on %s\n", socketpath);
+        close(server);
+        return 1;
+    }
+    for (;;){
+        int client = accept(server, 0, 0);
+        if (client < 0){
+            continue;
+        }
+        auto handler = [client, &Options]{
+            ServeConnection conn;
+            conn.in = fdopen(client, "r");
+            conn.out = 0;
+            conn.fd = client;
+            conn.jobs = 0;
+            if (!conn.in){
+                close(client);
+                return;
+            }
+            ServeConnectionLoop(&conn, Options);
+            fclose(conn.in);
+        };
+#ifndef NOMULTI
+        std::thread(handler).detach();
+#else
+        handler();
+#endif
+    }
+#endif
+}
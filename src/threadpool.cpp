@@ -0,0 +1,238 @@
+//
+//  threadpool.cpp
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+
+#include "threadpool.h"
+#include "timing.h"
+
+#ifndef NOMULTI
+#include <deque>
+#include <thread>
+#include <vector>
+
+#define POOL_MAX_THREADS 256
+
+struct PoolTask {
+  TaskGroup* group;
+  std::function<void()> fn;
+};
+
+struct WorkQueue {
+  std::mutex mtx;
+  std::deque<PoolTask> tasks;
+};
+
+/* Queue 0 is shared by threads outside the pool, queue i belongs to worker i.
+ Workers push and pop at the back of their own queue and steal from the front of
+ the others. */
+class ThreadPool {
+ public:
+  static ThreadPool& Global() {
+    //Never destroyed: workers may still be sleeping when the process exits.
+    static ThreadPool* pool = new ThreadPool;
+    return *pool;
+  }
+
+  void Grow(unsigned threads) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (threads > POOL_MAX_THREADS) {
+      threads = POOL_MAX_THREADS;
+    }
+    while (workers.size() + 1 < threads) {
+      unsigned index = workers.size() + 1;
+      workers.emplace_back(&ThreadPool::WorkerLoop, this, index);
+      nworkers.store(workers.size());
+    }
+  }
+
+  unsigned Threads() {
+    return nworkers.load() + 1;
+  }
+
+  static unsigned Current() {
+    return current;
+  }
+
+  void Submit(PoolTask task) {
+    WorkQueue& q = queues[current];
+    q.mtx.lock();
+    q.tasks.push_back(std::move(task));
+    q.mtx.unlock();
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      submitted++;
+    }
+    cv.notify_one();
+  }
+
+  /* Runs one queued task, restricted to tasks of group only if it is set.
+   Returns whether a task was run. */
+  bool RunOne(TaskGroup* only) {
+    PoolTask task;
+    unsigned n = nworkers.load() + 1;
+    if (!Take(queues[current], only, true, task)) {
+      unsigned i = 1;
+      for (; i < n; i++) {
+        if (Take(queues[(current + i) % n], only, false, task)) {
+          break;
+        }
+      }
+      if (i == n) {
+        return false;
+      }
+    }
+    task.fn();
+    task.group->Done();
+    return true;
+  }
+
+ private:
+  ThreadPool() : nworkers(0), submitted(0) {}
+
+  static bool Take(WorkQueue& q, TaskGroup* only, bool back, PoolTask& task) {
+    std::lock_guard<std::mutex> lock(q.mtx);
+    if (q.tasks.empty()) {
+      return false;
+    }
+    if (!only) {
+      if (back) {
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      }
+      else {
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+      return true;
+    }
+    if (back) {
+      for (auto it = q.tasks.rbegin(); it != q.tasks.rend(); ++it) {
+        if (it->group == only) {
+          task = std::move(*it);
+          q.tasks.erase(std::next(it).base());
+          return true;
+        }
+      }
+      return false;
+    }
+    for (auto it = q.tasks.begin(); it != q.tasks.end(); ++it) {
+      if (it->group == only) {
+        task = std::move(*it);
+        q.tasks.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void WorkerLoop(unsigned index) {
+    current = index;
+    for (;;) {
+      //Anything submitted before this was either found below or taken by another thread
+      size_t seen = submitted.load();
+      if (RunOne(0)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [this, seen]{return submitted.load() != seen;});
+    }
+  }
+
+  static thread_local unsigned current;
+  WorkQueue queues[POOL_MAX_THREADS];
+  std::vector<std::thread> workers;
+  std::atomic<unsigned> nworkers;
+  std::mutex mtx;
+  std::condition_variable cv;
+  //Number of tasks ever submitted, written under mtx so that sleeping workers don't miss it
+  std::atomic<size_t> submitted;
+};
+
+thread_local unsigned ThreadPool::current = 0;
+
+void TaskGroup::Run(std::function<void()> task) {
+  ThreadPool& pool = ThreadPool::Global();
+  if (pool.Threads() == 1) {
+    task();
+    return;
+  }
+  pending++;
+  //Keep reporting stages for the file that submitted the task
+  void* context = TimingGetContext();
+  if (context) {
+    std::function<void()> inner = std::move(task);
+    task = [inner, context]{
+      void* previous = TimingSetContext(context);
+      inner();
+      TimingSetContext(previous);
+    };
+  }
+  pool.Submit(PoolTask{this, std::move(task)});
+}
+
+void TaskGroup::Wait() {
+  ThreadPool& pool = ThreadPool::Global();
+  while (pending.load()) {
+    if (pool.RunOne(this)) {
+      continue;
+    }
+    //Remaining tasks of this group are running on other threads.
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{return pending.load() == 0;});
+  }
+  //Don't return while Done() still holds the lock.
+  std::lock_guard<std::mutex> lock(mtx);
+}
+
+void TaskGroup::Done() {
+  std::lock_guard<std::mutex> lock(mtx);
+  if (--pending == 0) {
+    cv.notify_all();
+  }
+}
+
+void ThreadPoolInit(unsigned threads) {
+  ThreadPool::Global().Grow(threads);
+}
+
+unsigned ThreadPoolThreads(void) {
+  return ThreadPool::Global().Threads();
+}
+
+unsigned ThreadPoolCurrentThread(void) {
+  return ThreadPool::Current();
+}
+
+#else
+
+void TaskGroup::Run(std::function<void()> task) {
+  task();
+}
+
+void TaskGroup::Wait() {}
+
+void TaskGroup::Done() {}
+
+void ThreadPoolInit(unsigned threads) {}
+
+unsigned ThreadPoolThreads(void) {
+  return 1;
+}
+
+unsigned ThreadPoolCurrentThread(void) {
+  return 0;
+}
+
+#endif
+
+void ThreadPoolParallelFor(size_t n, void (*fn)(void* context, size_t i), void* context) {
+  TaskGroup group;
+  for (size_t i = 0; i < n; i++) {
+    group.Run([fn, context, i]{fn(context, i);});
+  }
+  group.Wait();
+}
@@ -0,0 +1,72 @@
+//
+//  threadpool.h
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+//  Process-wide work-stealing pool shared by file-level (--mt-file) and
+//  block-level (--mt-deflate) parallelism, so that both draw from one thread
+//  budget and idle file workers can help with the blocks of the last large file.
+
+#ifndef __Efficient_Compression_Tool__threadpool__
+#define __Efficient_Compression_Tool__threadpool__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sets the total number of threads used for compression, including the
+ thread that waits for submitted work. Can only grow the pool. */
+void ThreadPoolInit(unsigned threads);
+
+/* Total number of threads available to the pool (at least 1). */
+unsigned ThreadPoolThreads(void);
+
+/* Index of the calling pool worker, 0 for threads outside the pool. */
+unsigned ThreadPoolCurrentThread(void);
+
+/* Calls fn(context, i) for every i below n on the pool and returns once all
+ calls have finished. For C code, which can't use TaskGroup. */
+void ThreadPoolParallelFor(size_t n, void (*fn)(void* context, size_t i), void* context);
+
+#ifdef __cplusplus
+}
+
+#include <atomic>
+#include <functional>
+#ifndef NOMULTI
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/* A set of tasks that is waited on together. Tasks may submit further groups
+ from inside the pool; waiting threads only help with tasks of their own group,
+ so thread_local state of the waiting code is never clobbered. */
+class TaskGroup {
+ public:
+  TaskGroup() : pending(0) {}
+  ~TaskGroup() {Wait();}
+
+  /* Queues a task. Without NOMULTI it runs on any pool thread. */
+  void Run(std::function<void()> task);
+
+  /* Returns once all tasks of this group have finished. The calling thread
+   executes queued tasks of this group while waiting. */
+  void Wait();
+
+ private:
+  friend class ThreadPool;
+  void Done();
+  std::atomic<size_t> pending;
+#ifndef NOMULTI
+  std::mutex mtx;
+  std::condition_variable cv;
+#endif
+};
+
+#endif
+
+#endif /* defined(__Efficient_Compression_Tool__threadpool__) */
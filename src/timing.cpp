@@ -0,0 +1,161 @@
+//
+//  timing.cpp
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+
+#include "timing.h"
+#include "threadpool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifndef NOMULTI
+#include <mutex>
+#endif
+
+struct TimingFile {
+  std::string name;
+  double start;
+  double deadline;
+};
+
+static FILE* report = 0;
+static bool csv = false;
+static double totaldeadline = 0;
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+static thread_local TimingFile* current = 0;
+#ifndef NOMULTI
+static std::mutex reportmtx;
+#endif
+
+static double Now() {
+  //Never 0, which marks disabled stages
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count() + 1e-9;
+}
+
+std::string TimingJSONString(const std::string& str) {
+  std::string result = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    }
+    else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      result += escape;
+    }
+    else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+static std::string Quote(const std::string& str) {
+  if (!csv) {
+    return TimingJSONString(str);
+  }
+  std::string result = "\"";
+  for (char c : str) {
+    if (c == '"') {
+      result += '"';
+    }
+    result += c;
+  }
+  return result + "\"";
+}
+
+static void WriteStage(const TimingFile* file, const char* stage, double start, double end, size_t in, size_t out) {
+  std::string name = Quote(file->name);
+  unsigned thread = ThreadPoolCurrentThread();
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(reportmtx);
+#endif
+  if (csv) {
+    fprintf(report, "%s,%s,%u,%.6f,%.6f,%zu,%zu\n", name.c_str(), stage, thread, start, end - start, in, out);
+  }
+  else {
+    fprintf(report, "{\"file\":%s,\"stage\":\"%s\",\"thread\":%u,\"start\":%.6f,\"seconds\":%.6f,\"in\":%zu,\"out\":%zu}\n",
+            name.c_str(), stage, thread, start, end - start, in, out);
+  }
+}
+
+bool TimingOpen(const char* path) {
+  size_t len = strlen(path);
+  csv = len > 4 && strcmp(path + len - 4, ".csv") == 0;
+  report = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (!report) {
+    return false;
+  }
+  if (csv) {
+    fprintf(report, "file,stage,thread,start,seconds,in,out\n");
+  }
+  return true;
+}
+
+void TimingSetTotalBudget(double seconds) {
+  totaldeadline = Now() + seconds;
+}
+
+void* TimingFileBegin(const char* file, double budget) {
+  TimingFile* previous = current;
+  if (report || budget > 0 || totaldeadline) {
+    current = new TimingFile;
+    current->name = file;
+    current->start = Now();
+    current->deadline = budget > 0 ? current->start + budget : 0;
+    if (totaldeadline && (!current->deadline || totaldeadline < current->deadline)) {
+      current->deadline = totaldeadline;
+    }
+    //Files nested in an archive can't take longer than the archive
+    if (previous && previous->deadline && (!current->deadline || previous->deadline < current->deadline)) {
+      current->deadline = previous->deadline;
+    }
+  }
+  return previous;
+}
+
+void TimingFileEnd(void* previous, size_t in, size_t out) {
+  if (current == previous) {
+    return;
+  }
+  if (report) {
+    WriteStage(current, "file", current->start, Now(), in, out);
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(reportmtx);
+#endif
+    fflush(report);
+  }
+  delete current;
+  current = (TimingFile*)previous;
+}
+
+void* TimingGetContext(void) {
+  return current;
+}
+
+void* TimingSetContext(void* context) {
+  TimingFile* previous = current;
+  current = (TimingFile*)context;
+  return previous;
+}
+
+double TimingStart(void) {
+  return current && report ? Now() : 0;
+}
+
+void TimingStage(const char* stage, double start, size_t in, size_t out) {
+  if (start && current) {
+    WriteStage(current, stage, start, Now(), in, out);
+  }
+}
+
+int TimingDeadlineExpired(void) {
+  return current && current->deadline && Now() > current->deadline;
+}
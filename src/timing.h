@@ -0,0 +1,68 @@
+//
+//  timing.h
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+//  Optional per-file and per-stage timing report (--timing). Every stage of the
+//  file being processed by the current thread is written as one line of JSON or
+//  CSV with its duration, the bytes it consumed and produced and the pool thread
+//  that ran it. Tasks submitted to the thread pool inherit the file of the
+//  thread that submitted them.
+//
+//  The same context carries the deadline of the file (--time-budget), which lets
+//  the iterative parts of the compressors stop early and keep their best result.
+
+#ifndef __Efficient_Compression_Tool__timing__
+#define __Efficient_Compression_Tool__timing__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returns the start time of a stage, or 0 if no report is written for the file
+ processed by the calling thread. */
+double TimingStart(void);
+
+/* Reports a stage that began at start, which was returned by TimingStart. Does
+ nothing if start is 0. in and out are byte counts, 0 if not meaningful. */
+void TimingStage(const char* stage, double start, size_t in, size_t out);
+
+/* Returns 1 if the time budget of the file processed by the calling thread is
+ used up. Callers should finish with the best result found so far. */
+int TimingDeadlineExpired(void);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+/* Returns str as a quoted JSON string. */
+std::string TimingJSONString(const std::string& str);
+
+/* Opens the report at path, "-" writes to stdout. The report is CSV if path ends
+ in .csv and JSON lines otherwise. Returns false if the file can't be created. */
+bool TimingOpen(const char* path);
+
+/* Limits the whole run to the given number of seconds, counted from now. */
+void TimingSetTotalBudget(double seconds);
+
+/* Makes file the current file of the calling thread, returning the previous
+ context to be passed to TimingFileEnd. budget is the number of seconds the file
+ may take, 0 for no limit. Does nothing without a report or time budget. */
+void* TimingFileBegin(const char* file, double budget);
+
+/* Reports the whole file with the sizes before and after optimization and
+ restores the previous context. */
+void TimingFileEnd(void* previous, size_t in, size_t out);
+
+/* Context of the calling thread, used to carry the current file into pool tasks. */
+void* TimingGetContext(void);
+void* TimingSetContext(void* context);
+
+#endif
+
+#endif /* defined(__Efficient_Compression_Tool__timing__) */
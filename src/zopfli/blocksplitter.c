@@ -24,24 +24,101 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "deflate.h"
 #include "lz77.h"
 #include "util.h"
+#include "../timing.h"
+#ifndef NOMULTI
+#include "../threadpool.h"
+#endif
+
+/* The cumulative symbol counts are stored every SPLIT_CHECKPOINT LZ77 symbols. */
+#define SPLIT_CHECKPOINT 1024
 
 typedef struct SplitCostContext {
-  const unsigned short* litlens;
-  const unsigned short* dists;
+  const unsigned* tokens;
   size_t start;
   size_t end;
-  unsigned char symbols;
+  size_t llsize;
+  /* Litlen (first 288) and dist (last 32) counts of all symbols before each
+  checkpoint, without the end symbol. */
+  const unsigned* prefix;
 } SplitCostContext;
 
+/*
+Builds the cumulative symbol counts of the checkpoints. Counting the symbols of
+any range then only needs to scan the symbols between its ends and the nearest
+checkpoints.
+*/
+static unsigned* SplitPrefixCounts(const unsigned* tokens, size_t llsize) {
+  size_t ncheckpoints = llsize / SPLIT_CHECKPOINT + 1;
+  unsigned* prefix = (unsigned*)malloc(ncheckpoints * 320 * sizeof(unsigned));
+  if (!prefix) exit(1); /* Allocation failed. */
+  ZopfliLZ77Histogram h;
+  ZopfliLZ77HistogramClear(&h);
+  for (size_t j = 0; j < ncheckpoints; j++) {
+    unsigned* cur = prefix + j * 320;
+    if (j) {
+      ZopfliLZ77HistogramAddRange(&h, tokens, (j - 1) * SPLIT_CHECKPOINT, j * SPLIT_CHECKPOINT);
+    }
+    for (unsigned i = 0; i < 288; i++) {
+      cur[i] = h.ll_count[i];
+    }
+    for (unsigned i = 0; i < 32; i++) {
+      cur[288 + i] = h.d_count[i];
+    }
+  }
+  return prefix;
+}
+
+/*
+Gets the same counts as ZopfliLZ77Counts for the symbols from start to end. The
+counts are linear in the symbols, so they are the difference of the counts up to
+end and up to start, each taken from the nearest checkpoint.
+*/
+static void SplitRangeCounts(const SplitCostContext* c, size_t start, size_t end, size_t* ll_count, size_t* d_count) {
+  if (end - start <= SPLIT_CHECKPOINT) {
+    ZopfliLZ77Counts(c->tokens, start, end, ll_count, d_count);
+    return;
+  }
+  size_t lastcheckpoint = c->llsize / SPLIT_CHECKPOINT;
+  size_t cstart = (start + SPLIT_CHECKPOINT / 2) / SPLIT_CHECKPOINT;
+  size_t cend = (end + SPLIT_CHECKPOINT / 2) / SPLIT_CHECKPOINT;
+  if (cstart > lastcheckpoint) cstart = lastcheckpoint;
+  if (cend > lastcheckpoint) cend = lastcheckpoint;
+  const unsigned* pstart = c->prefix + cstart * 320;
+  const unsigned* pend = c->prefix + cend * 320;
+  ZopfliLZ77Histogram h;
+  for (unsigned i = 0; i < 288; i++) {
+    h.ll_count[i] = pend[i] - pstart[i];
+  }
+  for (unsigned i = 0; i < 32; i++) {
+    h.d_count[i] = pend[288 + i] - pstart[288 + i];
+  }
+  size_t pos = cend * SPLIT_CHECKPOINT;
+  if (end > pos) {
+    ZopfliLZ77HistogramAddRange(&h, c->tokens, pos, end);
+  } else {
+    ZopfliLZ77HistogramSubtractRange(&h, c->tokens, end, pos);
+  }
+  pos = cstart * SPLIT_CHECKPOINT;
+  if (start > pos) {
+    ZopfliLZ77HistogramSubtractRange(&h, c->tokens, pos, start);
+  } else {
+    ZopfliLZ77HistogramAddRange(&h, c->tokens, start, pos);
+  }
+  memcpy(ll_count, h.ll_count, sizeof(h.ll_count));
+  memcpy(d_count, h.d_count, sizeof(h.d_count));
+  ll_count[256] = 1;
+}
+
 /*
  Gets the cost which is the sum of the cost of the left and the right section
  of the data.
  */
-static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext, unsigned entropysplit, const size_t* ll_count, const size_t* d_count, const size_t* ll_count2, const size_t* d_count2, size_t pos2) {
+static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext, unsigned entropysplit, const size_t* ll_count, const size_t* d_count) {
   double result = 3;
   unsigned ll_lengths[288];
   unsigned d_lengths[32];
@@ -53,34 +130,16 @@ static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext,
   }
   size_t ll_counts[288];
   size_t d_counts[32];
+  /* The order of the sections affects the rounding of the sum. Keep evaluating
+  the shorter one first, or the left one if the split is close to the middle. */
+  size_t pos2 = c->end - (c->end - c->start) / 2;
   unsigned x = i - c->start < c->end - i;
   unsigned dist = x ? i - c->start : c->end - i;
   unsigned dist2 = i > pos2 ? i - pos2 : pos2 - i;
   if(dist2 < dist && dist2){
-    x = i > pos2;
-    if(x){
-      ZopfliLZ77Counts(c->litlens, c->dists, pos2, i, ll_counts, d_counts, c->symbols);
-      for(size_t ix = 0; ix < 286; ix++){
-        ll_counts[ix] = ll_count2[ix] + ll_counts[ix];
-      }
-      for(size_t ix = 0; ix < 30; ix++){
-        d_counts[ix] = d_count2[ix] + d_counts[ix];
-      }
-    }
-    else{
-      ZopfliLZ77Counts(c->litlens, c->dists, i, pos2, ll_counts, d_counts, c->symbols);
-      for(size_t ix = 0; ix < 286; ix++){
-        ll_counts[ix] = ll_count2[ix] - ll_counts[ix];
-      }
-      for(size_t ix = 0; ix < 30; ix++){
-        d_counts[ix] = d_count2[ix] - d_counts[ix];
-      }
-    }
+    x = 1;
   }
-  else{
-    ZopfliLZ77Counts(c->litlens, c->dists, x ? c->start : i, x ? i : c->end, ll_counts, d_counts, c->symbols);
-  }
-  ll_counts[256] = 1;
+  SplitRangeCounts(c, x ? c->start : i, x ? i : c->end, ll_counts, d_counts);
 
   result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_counts, d_counts) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
   result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
@@ -97,6 +156,34 @@ static double SplitCost(size_t i, SplitCostContext* c, unsigned char searchext,
   return result;
 }
 
+/* Calls fn(context, i) for every i below n, on the thread pool with --mt-deflate. */
+static void SplitForEach(size_t n, void (*fn)(void* context, size_t i), void* context, const ZopfliOptions* options) {
+#ifndef NOMULTI
+  if (options->multithreading > 1 && n > 1) {
+    ThreadPoolParallelFor(n, fn, context);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) {
+    fn(context, i);
+  }
+}
+
+typedef struct SplitProbes {
+  SplitCostContext* c;
+  const size_t* pos;
+  double* cost;
+  unsigned char searchext;
+  unsigned entropysplit;
+  const size_t* ll_count;
+  const size_t* d_count;
+} SplitProbes;
+
+static void SplitProbe(void* context, size_t i) {
+  SplitProbes* p = (SplitProbes*)context;
+  p->cost[i] = SplitCost(p->pos[i], p->c, p->searchext, p->entropysplit, p->ll_count, p->d_count);
+}
+
 /*
 Finds minimum of function f(i) where is is of type size_t, f(i) is of type
 double, i is in range start-end (excluding end).
@@ -105,12 +192,7 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
   //Count LZ77 symbols once, then, on later runs, just for 1st potential block and subtract
   size_t ll_count[288];
   size_t d_count[32];
-  size_t ll_count2[288];
-  size_t d_count2[32];
-  ZopfliLZ77Counts(context->litlens, context->dists, context->start, context->end, ll_count, d_count, context->symbols);
-  size_t pos2 = context->end - (context->end - context->start) / 2;
-  ZopfliLZ77Counts(context->litlens, context->dists, context->start, pos2, ll_count2, d_count2, context->symbols);
-
+  SplitRangeCounts(context, context->start, context->end, ll_count, d_count);
 
   size_t startsize = end - start;
   /* Try to find minimum by recursively checking multiple points. */
@@ -124,14 +206,23 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
   double lastbest = ZOPFLI_LARGE_FLOAT;
   size_t pos = start;
   size_t ostart = start;
+  /* Probes of one round are independent and may be evaluated in parallel. */
+  size_t q[NUM];
+  double vq[NUM];
+  size_t nq;
+  SplitProbes probes = {context, q, vq, (unsigned char)(options->searchext & 2), options->entropysplit, ll_count, d_count};
   for (;;) {
     if (end - start <= options->num){
       if (options->numiterations > 30){
-        for (unsigned j = 0; j < end - start; j++){
-          double cost = SplitCost(start + j, context, options->searchext & 2, options->entropysplit, ll_count, d_count, ll_count2, d_count2, pos2);
-          if (cost < best){
-            best = cost;
-            pos = start + j;
+        nq = end - start;
+        for (i = 0; i < nq; i++){
+          q[i] = start + i;
+        }
+        SplitForEach(nq, SplitProbe, &probes, options);
+        for (i = 0; i < nq; i++){
+          if (vq[i] < best){
+            best = vq[i];
+            pos = q[i];
           }
         }
       }
@@ -139,13 +230,23 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
     }
     if (end - start <= startsize/100 && startsize > 600 && options->num == 3) break;
 
+    nq = 0;
     for (i = 0; i < options->num; i++) {
       p[i] = start + (i + 1) * ((end - start) / (options->num + 1));
       if (pos == p[i] || (i == (options->num - 1) / 2 && prevstore != -1 && options->num == 3)){
-        vp[i] = best;
         continue;
       }
-      vp[i] = SplitCost(p[i], context, options->searchext & 2, options->entropysplit, ll_count, d_count, ll_count2, d_count2, pos2);
+      q[nq++] = p[i];
+    }
+    SplitForEach(nq, SplitProbe, &probes, options);
+    nq = 0;
+    for (i = 0; i < options->num; i++) {
+      if (pos == p[i] || (i == (options->num - 1) / 2 && prevstore != -1 && options->num == 3)){
+        vp[i] = best;
+      }
+      else {
+        vp[i] = vq[nq++];
+      }
     }
     besti = 0;
     best = vp[0];
@@ -164,7 +265,7 @@ static size_t FindMinimum(SplitCostContext* context, size_t start, size_t end, u
     pos = p[besti];
     lastbest = best;
   }
-  double origcost = SplitCost(context->end, context, options->searchext & 2, options->entropysplit, ll_count, d_count, ll_count2, d_count2, pos2);
+  double origcost = SplitCost(context->end, context, options->searchext & 2, options->entropysplit, ll_count, d_count);
   if(origcost <= best){
     pos = ostart;
   }
@@ -223,26 +324,155 @@ static int FindLargestSplittableBlock(
   return found;
 }
 
-static void ZopfliBlockSplitLZ77(const unsigned short* litlens,
-                          const unsigned short* dists,
+/* Cost of encoding the symbols from start to end as one dynamic block. */
+static double BlockCost(const SplitCostContext* c, size_t start, size_t end, unsigned char searchext, unsigned entropysplit) {
+  size_t ll_count[288];
+  size_t d_count[32];
+  unsigned ll_lengths[288];
+  unsigned d_lengths[32];
+  unsigned dummy;
+  SplitRangeCounts(c, start, end, ll_count, d_count);
+  double result = 3;
+  result += entropysplit ? GetDynamicLengths2(ll_lengths, d_lengths, ll_count, d_count) : GetDynamicLengthsuse(ll_lengths, d_lengths, ll_count, d_count);
+  result += CalculateTreeSize(ll_lengths, d_lengths, searchext, &dummy);
+  return result;
+}
+
+typedef struct BlockCosts {
+  const SplitCostContext* c;
+  const size_t* grid;
+  double* cost;
+  size_t end;
+  unsigned char searchext;
+  unsigned entropysplit;
+} BlockCosts;
+
+/* Cost of the block from grid position i to the end of the row. */
+static void RowCost(void* context, size_t i) {
+  BlockCosts* row = (BlockCosts*)context;
+  row->cost[i] = BlockCost(row->c, row->grid[i], row->grid[row->end], row->searchext, row->entropysplit);
+}
+
+/*
+Splits into the cheapest sequence of blocks whose boundaries lie on a grid of at
+most options->optimalsplit + 1 evenly spaced positions, found by dynamic
+programming over the costs of all ranges between grid positions. Each boundary
+is then moved to the best position between its grid neighbours with
+FindMinimum. Unlike recursive splitting, this finds good partitions where no
+single split pays off on its own.
+*/
+static void ZopfliBlockSplitOptimal(const SplitCostContext* base, size_t llsize, size_t** splitpoints,
+                                    size_t* npoints, const ZopfliOptions* options) {
+  size_t ncand = llsize / options->noblocksplitlz;
+  if (ncand > options->optimalsplit) {
+    ncand = options->optimalsplit;
+  }
+  if (ncand < 2) {
+    return;
+  }
+  size_t* grid = (size_t*)malloc((ncand + 1) * sizeof(size_t));
+  size_t* from = (size_t*)malloc((ncand + 1) * sizeof(size_t));
+  size_t* chosen = (size_t*)malloc((ncand + 1) * sizeof(size_t));
+  double* best = (double*)malloc((ncand + 1) * sizeof(double));
+  double* cost = (double*)malloc(ncand * sizeof(double));
+  if (!grid || !from || !chosen || !best || !cost) exit(1); /* Allocation failed. */
+  for (size_t i = 0; i <= ncand; i++) {
+    grid[i] = i * llsize / ncand;
+  }
+
+  /* The blocks ending at one grid position are independent of each other. */
+  BlockCosts row = {base, grid, cost, 0, (unsigned char)(options->searchext & 2), options->entropysplit};
+  best[0] = 0;
+  for (size_t j = 1; j <= ncand; j++) {
+    row.end = j;
+    SplitForEach(j, RowCost, &row, options);
+    best[j] = ZOPFLI_LARGE_FLOAT;
+    for (size_t i = 0; i < j; i++) {
+      double total = best[i] + cost[i];
+      if (total < best[j]) {
+        best[j] = total;
+        from[j] = i;
+      }
+    }
+  }
+
+  /* Collect the chosen grid indices, from the end. */
+  size_t nchosen = 0;
+  for (size_t j = ncand; j; j = from[j]) {
+    chosen[nchosen++] = j;
+  }
+
+  size_t left = 0;
+  for (size_t k = nchosen - 1; k > 0; k--) {
+    size_t g = chosen[k];
+    size_t right = grid[chosen[k - 1]];
+    SplitCostContext c = *base;
+    c.start = left;
+    c.end = right;
+    size_t ll_count[288];
+    size_t d_count[32];
+    SplitRangeCounts(&c, c.start, c.end, ll_count, d_count);
+    size_t lo = grid[g - 1] + (grid[g] - grid[g - 1]) / 2;
+    size_t hi = grid[g] + (grid[g + 1] - grid[g]) / 2;
+    size_t pos = grid[g];
+    if (lo <= left) {
+      lo = left + 1;
+    }
+    if (hi > right) {
+      hi = right;
+    }
+    unsigned char enough;
+    size_t refined = FindMinimum(&c, lo, hi, &enough, options);
+    if (refined > lo && refined != pos
+        && SplitCost(refined, &c, options->searchext & 2, options->entropysplit, ll_count, d_count)
+        < SplitCost(pos, &c, options->searchext & 2, options->entropysplit, ll_count, d_count)) {
+      pos = refined;
+    }
+    AddSorted(pos, splitpoints, npoints);
+    left = pos;
+  }
+
+  free(grid);
+  free(from);
+  free(chosen);
+  free(best);
+  free(cost);
+}
+
+static void ZopfliBlockSplitLZ77(const unsigned* tokens,
                           size_t llsize, size_t** splitpoints,
-                          size_t* npoints, const ZopfliOptions* options, unsigned char symbols) {
+                          size_t* npoints, const ZopfliOptions* options) {
   if (llsize < options->noblocksplitlz) return;  /* This code fails on tiny files. */
 
+  unsigned* prefix = SplitPrefixCounts(tokens, llsize);
+  if (options->optimalsplit) {
+    SplitCostContext c;
+    c.tokens = tokens;
+    c.start = 0;
+    c.end = llsize;
+    c.llsize = llsize;
+    c.prefix = prefix;
+    ZopfliBlockSplitOptimal(&c, llsize, splitpoints, npoints, options);
+  }
+
   size_t llpos;
   int splittingleft = 0;
   unsigned char* done = (unsigned char*)calloc(llsize, 1);
   if (!done) exit(1); /* Allocation failed. */
   size_t lstart = 0;
   size_t lend = llsize;
+  /* Split the blocks of the optimal partition further. */
+  if (*npoints) {
+    FindLargestSplittableBlock(llsize, done, *splitpoints, *npoints, &lstart, &lend);
+  }
   for (;;) {
     SplitCostContext c;
 
-    c.litlens = litlens;
-    c.dists = dists;
+    c.tokens = tokens;
     c.start = lstart;
     c.end = lend;
-    c.symbols = symbols;
+    c.llsize = llsize;
+    c.prefix = prefix;
     assert(lstart < lend);
     unsigned char enough = 0;
     llpos = FindMinimum(&c, lstart + 1, lend, &enough, options);
@@ -266,19 +496,14 @@ static void ZopfliBlockSplitLZ77(const unsigned short* litlens,
     if (lend - lstart < options->noblocksplitlz) {
       break;
     }
+    /* Out of time, keep the splits found so far. */
+    if (TimingDeadlineExpired()) {
+      break;
+    }
   }
 
   free(done);
-}
-
-static unsigned symtox(unsigned lls){
-  if (lls <= 279){
-    return 0;
-  }
-  if (lls <= 283){
-    return 100;
-  }
-  return 200;
+  free(prefix);
 }
 
 void ZopfliBlockSplit(const ZopfliOptions* options,
@@ -296,13 +521,9 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   ZopfliInitLZ77Store(&store);
   if (!(twiceMode & 2)){
     ZopfliLZ77Lazy(options, in, instart, inend, &store);
-    store.symbols = 1;
   }
   else{
-    store.size = twiceStore.size;
-    store.litlens = twiceStore.litlens;
-    store.dists = twiceStore.dists;
-    store.symbols = twiceStore.symbols;
+    store = twiceStore;
   }
 
   /* Blocksplitting likely won't improve compression on small files */
@@ -313,7 +534,7 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
     return;
   }
 
-  ZopfliBlockSplitLZ77(store.litlens, store.dists, store.size, &lz77splitpoints, &nlz77points, options, store.symbols);
+  ZopfliBlockSplitLZ77(store.tokens, store.size, &lz77splitpoints, &nlz77points, options);
 
   *stats = (SymbolStats*)realloc(*stats, (nlz77points + prevpoints + 1) * sizeof(SymbolStats));
   if (!(*stats)){
@@ -324,27 +545,15 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   pos = instart;
   if (nlz77points) {
     for (i = 0; i < store.size; i++) {
-      size_t length = store.symbols ? store.litlens[i] < 256 ? 1 : symtox(store.litlens[i] & 511) + (store.litlens[i] >> 9) : store.dists[i] == 0 ? 1 : store.litlens[i];
+      size_t length = ZopfliTokenLength(store.tokens[i]);
       if (lz77splitpoints[(*npoints) - prevpoints] == i) {
         size_t temp = store.size;
         size_t shift = (*npoints) - prevpoints ? lz77splitpoints[*npoints - prevpoints - 1] : 0;
         store.size = i - shift;
-        if (store.symbols){
-          store.dists = (unsigned short*)(((unsigned char*)(store.dists)) + shift);
-        }
-        else{
-          store.dists += shift;
-        }
-        store.litlens += shift;
+        store.tokens += shift;
         GetStatistics(&store, &((*stats)[*npoints]));
         store.size = temp;
-        if (store.symbols){
-          store.dists = (unsigned short*)(((unsigned char*)(store.dists)) - shift);
-        }
-        else{
-          store.dists -= shift;
-        }
-        store.litlens -= shift;
+        store.tokens -= shift;
         ZOPFLI_APPEND_DATA(pos, splitpoints, npoints);
         if (*npoints - prevpoints == nlz77points) break;
       }
@@ -355,23 +564,11 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
 
   size_t shift = *npoints - prevpoints ? lz77splitpoints[*npoints - prevpoints - 1] : 0;
   store.size -= shift;
-  if (store.symbols){
-    store.dists = (unsigned short*)(((unsigned char*)(store.dists)) + shift);
-  }
-  else{
-    store.dists += shift;
-  }
-  store.litlens += shift;
+  store.tokens += shift;
 
   GetStatistics(&store, &((*stats)[*npoints]));
   store.size += shift;
-  if (store.symbols){
-    store.dists = (unsigned short*)(((unsigned char*)(store.dists)) - shift);
-  }
-  else{
-    store.dists -= shift;
-  }
-  store.litlens -= shift;
+  store.tokens -= shift;
 
   free(lz77splitpoints);
   ZopfliCleanLZ77Store(&store);
@@ -25,6 +25,9 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "lz77.h"
 #include "squeeze.h"
 #include "katajainen.h"
+#include "matchcache.h"
+#include "../timing.h"
+#include "../threadLocal.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -33,9 +36,8 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include <math.h>
 
 #ifndef NOMULTI
-#include <thread>
 #include <vector>
-#include <mutex>
+#include "../threadpool.h"
 #endif
 
 /*
@@ -331,31 +333,169 @@ static size_t EncodeTree(const unsigned* ll_lengths,
   return result_size;
 }
 
+/*
+Adds the code length code counts for a run of count equal code lengths, the
+same way EncodeTree emits them with the given flags.
+*/
+static void AddTreeRunCounts(unsigned symbol, unsigned count,
+                             int use_16, int use_17, int use_18, int fuse_8, int fuse_7,
+                             size_t* clcounts) {
+  if (!use_16 && !(symbol == 0 && (use_17 || use_18))) {
+    /* Not run-length encoded, every length is sent on its own. */
+    clcounts[symbol] += count;
+    return;
+  }
+  if (symbol == 0 && count >= 3) {
+    if (use_18) {
+      while (count >= 11) {
+        clcounts[18]++;
+        count -= count > 138 ? 138 : count;
+      }
+    }
+    if (use_17) {
+      while (count >= 3) {
+        clcounts[17]++;
+        count -= count > 10 ? 10 : count;
+      }
+    }
+  }
+  if (use_16 && count >= 4) {
+    count--;
+    clcounts[symbol]++;
+    while (count >= 3) {
+      if ((fuse_8 && count == 8) || (fuse_7 && count == 7)) {
+        clcounts[16] += 2;
+        count = 0;
+      } else {
+        clcounts[16]++;
+        count -= count > 6 ? 6 : count;
+      }
+    }
+  }
+  clcounts[symbol] += count;
+}
+
+/*
+Same result as EncodeTree without output, given the code length code counts of
+the RLE'd trees.
+*/
+static size_t TreeSizeFromCounts(const size_t* clcounts) {
+  static const unsigned order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+  };
+  unsigned clcl[19];
+  ZopfliLengthLimitedCodeLengths(clcounts, 19, 7, clcl);
+
+  unsigned hclen = 15;
+  while (hclen && clcounts[order[hclen + 4 - 1]] == 0) hclen--;
+
+  size_t result_size = 14 + (hclen + 4) * 3;
+  for (unsigned i = 0; i < 19; i++) {
+    result_size += clcl[i] * clcounts[i];
+  }
+  result_size += clcounts[16] * 2;
+  result_size += clcounts[17] * 3;
+  result_size += clcounts[18] * 7;
+  return result_size;
+}
+
+/*
+Small per-thread memo of tree sizes. The block splitter, GetAdvancedLengths and
+AddLZ77Block often ask for the same pair of trees more than once.
+*/
+#define TREESIZE_CACHE_SIZE 64
+#define TREESIZE_KEY_SIZE (286 + 30)
+
+typedef struct TreeSizeCacheEntry {
+  unsigned char lengths[TREESIZE_KEY_SIZE];
+  unsigned char hq;  /* hq + 1, 0 for an empty slot. */
+  unsigned char best;
+  size_t size;
+} TreeSizeCacheEntry;
+
+static thread_local TreeSizeCacheEntry treesizecache[TREESIZE_CACHE_SIZE];
+
 /*
 Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
 */
 size_t CalculateTreeSize(const unsigned* ll_lengths,
                                 unsigned* d_lengths, unsigned char hq, unsigned* best) {
   PatchDistanceCodesForBuggyDecoders(d_lengths);
+
+  unsigned char key[TREESIZE_KEY_SIZE];
+  unsigned hash = 2166136261u;
+  for (unsigned i = 0; i < TREESIZE_KEY_SIZE; i++) {
+    key[i] = i < 286 ? ll_lengths[i] : d_lengths[i - 286];
+    hash = (hash ^ key[i]) * 16777619u;
+  }
+  hash = (hash ^ hq) * 16777619u;
+  TreeSizeCacheEntry* entry = &treesizecache[(hash ^ (hash >> 16)) % TREESIZE_CACHE_SIZE];
+  if (entry->hq == hq + 1 && !memcmp(entry->lengths, key, TREESIZE_KEY_SIZE)) {
+    *best = entry->best;
+    return entry->size;
+  }
+
+  /* Trim zeros, as in EncodeTree. */
+  unsigned hlit = 29;
+  unsigned hdist = 29;
+  while (hlit && key[257 + hlit - 1] == 0) hlit--;
+  while (hdist && key[286 + hdist] == 0) hdist--;
+
+  /* Runs of equal lengths over the concatenated trees. */
+  unsigned char runsymbols[286 + 30];
+  unsigned runlengths[286 + 30];
+  size_t numruns = 0;
+  unsigned hlit2 = hlit + 257;
+  unsigned lld_total = hlit2 + hdist + 1;
+  for (unsigned i = 0; i < lld_total; i++) {
+    unsigned char symbol = key[i < hlit2 ? i : i - hlit2 + 286];
+    if (numruns && runsymbols[numruns - 1] == symbol) {
+      runlengths[numruns - 1]++;
+    } else {
+      runsymbols[numruns] = symbol;
+      runlengths[numruns++] = 1;
+    }
+  }
+
+  /* Flag combinations often give the same counts, e.g. the fuse flags on trees
+  without runs of 7 or 8, so each distinct set of counts is only sized once. */
+  size_t seencounts[20][19];
+  size_t seensizes[20];
+  unsigned numseen = 0;
   size_t result = 0;
-  if (hq){
-    for(unsigned i = 0; i < (hq == 2 ? 32 : 10); i++) {
-      if (!(i & 1) && (i & 8 || i & 16)){
-        continue;
-      }
-      size_t size = EncodeTree(ll_lengths, d_lengths,
-                               i & 1, i & 2, i & 4, i & 8, i & 16 || (hq == 1 && i == 9),
-                               0, 0, 0);
-      if (result == 0 || size < result){
-        result = size;
-        *best = i;
+  unsigned combos = hq ? (hq == 2 ? 32 : 10) : 8;
+  for (unsigned i = hq ? 0 : 7; i < combos; i++) {
+    if (!(i & 1) && (i & 8 || i & 16)){
+      continue;
+    }
+    int fuse_7 = i & 16 || (hq == 1 && i == 9);
+    size_t clcounts[19] = {0};
+    for (size_t j = 0; j < numruns; j++) {
+      AddTreeRunCounts(runsymbols[j], runlengths[j], i & 1, i & 2, i & 4, i & 8, fuse_7, clcounts);
+    }
+    size_t size = 0;
+    for (unsigned j = 0; j < numseen; j++) {
+      if (!memcmp(seencounts[j], clcounts, sizeof(clcounts))) {
+        size = seensizes[j];
+        break;
       }
     }
-
-    return result;
+    if (!size) {
+      size = TreeSizeFromCounts(clcounts);
+      memcpy(seencounts[numseen], clcounts, sizeof(clcounts));
+      seensizes[numseen++] = size;
+    }
+    if (result == 0 || size < result){
+      result = size;
+      *best = i;
+    }
   }
-  *best = 7;
-  return EncodeTree(ll_lengths, d_lengths, 1, 1, 1, 0, 0, 0, 0, 0);
+
+  memcpy(entry->lengths, key, TREESIZE_KEY_SIZE);
+  entry->hq = hq + 1;
+  entry->best = *best;
+  entry->size = result;
+  return result;
 }
 
 /*
@@ -364,8 +504,7 @@ end code 256. expected_data_size is the uncompressed block size, used for
 assert, but you can set it to 0 to not do the assertion.
 */
 //TODO: Rewrite for x86_64 where bitbuffer is refilled once per len/dist pair
-static void AddLZ77Data(const unsigned short* litlens,
-                        const unsigned short* dists,
+static void AddLZ77Data(const unsigned* tokens,
                         size_t lstart, size_t lend,
                         size_t expected_data_size,
                         unsigned* ll_symbols, const unsigned* ll_lengths,
@@ -395,16 +534,14 @@ static void AddLZ77Data(const unsigned short* litlens,
       ll_symbols[i] |= (!!bit2) << j;
     }
   }
-  unsigned len_symbols[259];
-  unsigned len_lengths[259];
-  for (i = 3; i < 259; i++){
-    unsigned lls = ZopfliGetLengthSymbol(i);
-    if(ll_lengths[lls]){
-      unsigned bitlen = ll_lengths[lls];
-      len_lengths[i] = bitlen + ZopfliGetLengthExtraBits(i);
-      assert(len_lengths[i] <= 25);
-      len_symbols[i] = ll_symbols[lls] + (ZopfliGetLengthExtraBitsValue(i) << bitlen);
-    }
+  unsigned len_lengths[286];
+  for (i = 257; i < 286; i++){
+    len_lengths[i] = ll_lengths[i] + ZopfliGetLengthSymbolExtraBits(i);
+    assert(len_lengths[i] <= 25);
+  }
+  unsigned d_extra[30];
+  for (i = 0; i < 30; i++){
+    d_extra[i] = ZopfliGetDistSymbolExtraBits(i);
   }
 
   size_t bits = (*outsize) * 8 + *bp - ((*bp) != 0) * 8;
@@ -416,9 +553,9 @@ static void AddLZ77Data(const unsigned short* litlens,
 #endif
 
   for (i = lstart; i < lend; i++) {
-    unsigned dist = dists[i];
-    unsigned litlen = litlens[i];
-    if (dist == 0) {
+    unsigned token = tokens[i];
+    unsigned litlen = ZOPFLI_TOKEN_LLSYMBOL(token);
+    if (!ZOPFLI_TOKEN_DSYMBOL1(token)) {
       assert(litlen < 256);
       assert(ll_lengths[litlen] > 0);
 #ifdef FAST_BITWRITER
@@ -428,34 +565,32 @@ static void AddLZ77Data(const unsigned short* litlens,
       AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
 #endif
     } else {
-      assert(litlen >= 3 && litlen <= ZOPFLI_MAX_MATCH);
-      unsigned ds = ZopfliGetDistSymbol(dist);
+      assert(litlen > 256 && litlen < 286);
+      assert(ll_lengths[litlen]);
+      unsigned ds = ZOPFLI_TOKEN_DSYMBOL1(token) - 1;
       assert(d_lengths[ds]);
 
 
 #ifdef FAST_BITWRITER
-      AddBits2(len_symbols[litlen],
+      AddBits2(ll_symbols[litlen] + (ZOPFLI_TOKEN_LLEXTRA(token) << ll_lengths[litlen]),
                len_lengths[litlen],
                out, &bits);
 
       AddBits2(d_symbols[ds], d_lengths[ds], out, &bits);
 
-      AddBits2(ZopfliGetDistExtraBitsValue(dist),
-               ZopfliGetDistExtraBits(dist),
+      AddBits2(ZOPFLI_TOKEN_DEXTRA(token),
+               d_extra[ds],
                out, &bits);
-      testlength += litlen;
+      testlength += ZopfliTokenLength(token);
 #else
-      unsigned lls = ZopfliGetLengthSymbol(litlen);
-      assert(ll_lengths[lls]);
-
-      AddHuffmanBits(ll_symbols[lls], ll_lengths[lls], bp, out, outsize);
-      AddBits(ZopfliGetLengthExtraBitsValue(litlen),
-              ZopfliGetLengthExtraBits(litlen),
+      AddHuffmanBits(ll_symbols[litlen], ll_lengths[litlen], bp, out, outsize);
+      AddBits(ZOPFLI_TOKEN_LLEXTRA(token),
+              ZopfliGetLengthSymbolExtraBits(litlen),
               bp, out, outsize);
 
       AddHuffmanBits(d_symbols[ds], d_lengths[ds], bp, out, outsize);
-      AddBits(ZopfliGetDistExtraBitsValue(dist),
-              ZopfliGetDistExtraBits(dist),
+      AddBits(ZOPFLI_TOKEN_DEXTRA(token),
+              ZopfliGetDistSymbolExtraBits(ds),
               bp, out, outsize);
 #endif
     }
@@ -681,10 +816,9 @@ lengths that give the smallest size of tree encoding + encoding of all the
 symbols to have smallest output size. This are not necessarily the ideal Huffman
 bit lengths.
 */
-static size_t GetAdvancedLengths(const unsigned short* litlens,
-                                 const unsigned short* dists,
+static size_t GetAdvancedLengths(const unsigned* tokens,
                                  size_t lstart, size_t lend,
-                                 unsigned* ll_lengths, unsigned* d_lengths, unsigned char symbols){
+                                 unsigned* ll_lengths, unsigned* d_lengths){
   size_t ll_counts[288];
   size_t d_counts[32];
   size_t ll_counts2[288];
@@ -693,7 +827,7 @@ static size_t GetAdvancedLengths(const unsigned short* litlens,
   size_t d_counts3[32];
   unsigned dummy;
 
-  ZopfliLZ77Counts(litlens, dists, lstart, lend, ll_counts, d_counts, symbols);
+  ZopfliLZ77Counts(tokens, lstart, lend, ll_counts, d_counts);
   memcpy(ll_counts2, ll_counts, 288 * sizeof(size_t));
   memcpy(d_counts2, d_counts, 32 * sizeof(size_t));
   memcpy(ll_counts3, ll_counts, 288 * sizeof(size_t));
@@ -782,14 +916,13 @@ size_t GetDynamicLengthsuse(unsigned* ll_lengths, unsigned* d_lengths, const siz
   return CalculateBlockSymbolSize(ll_counts, d_counts, ll_lengths, d_lengths);
 }
 
-static size_t GetDynamicLengths(const unsigned short* litlens,
-                                const unsigned short* dists,
+static size_t GetDynamicLengths(const unsigned* tokens,
                                 size_t lstart, size_t lend,
-                                unsigned* ll_lengths, unsigned* d_lengths, unsigned char symbols) {
+                                unsigned* ll_lengths, unsigned* d_lengths) {
   size_t ll_counts[288];
   size_t d_counts[32];
 
-  ZopfliLZ77Counts(litlens, dists, lstart, lend, ll_counts, d_counts, symbols);
+  ZopfliLZ77Counts(tokens, lstart, lend, ll_counts, d_counts);
   return GetDynamicLengthsuse(ll_lengths, d_lengths, ll_counts, d_counts);
 }
 
@@ -851,9 +984,8 @@ size_t GetDynamicLengths2(unsigned* ll_lengths, unsigned* d_lengths, const size_
   return result;
 }
 
-double ZopfliCalculateBlockSize(const unsigned short* litlens,
-                                const unsigned short* dists,
-                                size_t lstart, size_t lend, int btype, unsigned char hq, unsigned char symbols) {
+double ZopfliCalculateBlockSize(const unsigned* tokens,
+                                size_t lstart, size_t lend, int btype, unsigned char hq) {
   double result = 3; /* bfinal and btype bits */
 
   if(btype == 1) {
@@ -861,13 +993,15 @@ double ZopfliCalculateBlockSize(const unsigned short* litlens,
     result += 7;
     result += 8 * (lend - lstart);
     for (i = lstart; i < lend; i++) {
-      if (dists[i] == 0) {
-        result += litlens[i] >= 144;
+      unsigned token = tokens[i];
+      unsigned lls = ZOPFLI_TOKEN_LLSYMBOL(token);
+      if (!ZOPFLI_TOKEN_DSYMBOL1(token)) {
+        result += lls >= 144;
       }
       else {
-        result += 5 - (litlens[i] < 115);
-        result += ZopfliGetLengthExtraBits(litlens[i]);
-        result += ZopfliGetDistExtraBits(dists[i]);
+        result += 5 - (lls < 280);
+        result += ZopfliGetLengthSymbolExtraBits(lls);
+        result += ZopfliGetDistSymbolExtraBits(ZOPFLI_TOKEN_DSYMBOL1(token) - 1);
       }
     }
     return result;
@@ -876,20 +1010,18 @@ double ZopfliCalculateBlockSize(const unsigned short* litlens,
   unsigned d_lengths[32];
   unsigned dummy;
   //TODO: Better for PNG, worse for enwik
-  //result += GetAdvancedLengths(litlens, dists, lstart, lend, ll_lengths, d_lengths, symbols);
-  result += GetDynamicLengths(litlens, dists, lstart, lend, ll_lengths, d_lengths, symbols);
+  //result += GetAdvancedLengths(tokens, lstart, lend, ll_lengths, d_lengths);
+  result += GetDynamicLengths(tokens, lstart, lend, ll_lengths, d_lengths);
   result += CalculateTreeSize(ll_lengths, d_lengths, hq, &dummy);
   return result;
 }
 
-static unsigned char ReplaceBadCodes(unsigned short** litlens,
-                            unsigned short** dists,
+static unsigned char ReplaceBadCodes(unsigned** tokens,
                             size_t* lend, const unsigned char* in, size_t instart, unsigned* ll_lengths, unsigned* d_lengths){
   size_t end = *lend;
 
-  unsigned short* litlens2 = (unsigned short*)malloc(end * 3 * sizeof(unsigned short));
-  unsigned short* dists2 = (unsigned short*)malloc(end * 3 * sizeof(unsigned short));
-  if (!(litlens2 && dists2)){
+  unsigned* tokens2 = (unsigned*)malloc(end * 3 * sizeof(unsigned));
+  if (!tokens2){
     exit(1);
   }
 
@@ -897,10 +1029,12 @@ static unsigned char ReplaceBadCodes(unsigned short** litlens,
   size_t k = 0;
   for (size_t i = 0; i < end; i++){
     unsigned char change = 0;
-    size_t length = (*dists)[i] == 0 ? 1 : (*litlens)[i];
+    unsigned token = (*tokens)[i];
+    size_t length = ZopfliTokenLength(token);
     if (length >= 3 && length <= 7){
       /*Check if the match is cheaper than several literals*/
-      const unsigned char* litplace = &in[pos - (*dists)[i]];
+      unsigned dist = ZopfliTokenDist(token);
+      const unsigned char* litplace = &in[pos - dist];
       unsigned litprice = 0;
       unsigned char cont = 1;
       for(unsigned j = 0; j < length; j++){
@@ -912,14 +1046,15 @@ static unsigned char ReplaceBadCodes(unsigned short** litlens,
         litprice += ll_lengths[*litplace++];
       }
       if (cont){
-        unsigned char distprice = ll_lengths[ZopfliGetLengthSymbol(length)] + ZopfliGetLengthExtraBits(length) + ZopfliGetDistExtraBits((*dists)[i])
-          + d_lengths[ZopfliGetDistSymbol((*dists)[i])];
+        unsigned lls = ZOPFLI_TOKEN_LLSYMBOL(token);
+        unsigned ds = ZOPFLI_TOKEN_DSYMBOL1(token) - 1;
+        unsigned char distprice = ll_lengths[lls] + ZopfliGetLengthSymbolExtraBits(lls) + ZopfliGetDistSymbolExtraBits(ds)
+          + d_lengths[ds];
         if (litprice < distprice){
-          litplace = &in[pos - (*dists)[i]];
+          litplace = &in[pos - dist];
           change = 1;
           for(unsigned j = 0; j < length; j++){
-            litlens2[i + k] = *litplace;
-            dists2[i + k] = 0;
+            tokens2[i + k] = *litplace;
             k++;
             litplace++;
           }
@@ -929,14 +1064,12 @@ static unsigned char ReplaceBadCodes(unsigned short** litlens,
       }
     }
     if (!change){
-      litlens2[i + k] = (*litlens)[i];
-      dists2[i + k] = (*dists)[i];
+      tokens2[i + k] = token;
     }
     pos += length;
   }
 
-  (*litlens) = litlens2;
-  (*dists) = dists2;
+  (*tokens) = tokens2;
   return end != *lend;
 }
 
@@ -945,10 +1078,7 @@ Adds a deflate block with the given LZ77 data to the output.
 options: global program options
 btype: the block type, must be 1 or 2
 final: whether to set the "final" bit on this block, must be the last block
-litlens: literal/length array of the LZ77 data, in the same format as in
-    ZopfliLZ77Store.
-dists: distance array of the LZ77 data, in the same format as in
-    ZopfliLZ77Store.
+tokens: the LZ77 data, in the same format as in ZopfliLZ77Store.
 lstart: where to start in the LZ77 data
 lend: where to end in the LZ77 data (not inclusive)
 expected_data_size: the uncompressed block size, used for assert, but you can
@@ -958,8 +1088,7 @@ out: dynamic output array to append to
 outsize: dynamic output array size
 */
 static void AddLZ77Block(int btype, int final,
-                         unsigned short* litlens,
-                         unsigned short* dists,
+                         unsigned* tokens,
                          size_t lend,
                          size_t expected_data_size,
                          unsigned char* bp,
@@ -981,24 +1110,22 @@ static void AddLZ77Block(int btype, int final,
     for (i = 256; i < 280; i++) ll_lengths[i] = 7;
     for (i = 280; i < 288; i++) ll_lengths[i] = 8;
     for (i = 0; i < 32; i++) d_lengths[i] = 5;
-    outpred = ZopfliCalculateBlockSize(litlens, dists, 0, lend, 1, 0, 0);
+    outpred = ZopfliCalculateBlockSize(tokens, 0, lend, 1, 0);
   } else{
     /* Dynamic block. */
     outpred = 3;
-    outpred += GetDynamicLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
+    outpred += GetDynamicLengths(tokens, 0, lend, ll_lengths, d_lengths);
     outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
 
     unsigned char change = 1;
     for (unsigned i = 0; i < replaceCodes; i++){
       if (!(i & 1)){
-        unsigned short * free1 = litlens;
-        unsigned short * free2 = dists;
-        change = ReplaceBadCodes(&litlens, &dists, &lend, in, instart, ll_lengths, d_lengths);
+        unsigned* free1 = tokens;
+        change = ReplaceBadCodes(&tokens, &lend, in, instart, ll_lengths, d_lengths);
         if (!change && i + 1 != replaceCodes && i){
           outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
         }
         free(free1);
-        free(free2);
         if (!change){
           break;
         }
@@ -1006,7 +1133,7 @@ static void AddLZ77Block(int btype, int final,
       else{
         //TODO: This may make compression worse due to bigger huffman headers.
         outpred = 3;
-        outpred += GetDynamicLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
+        outpred += GetDynamicLengths(tokens, 0, lend, ll_lengths, d_lengths);
         if (replaceCodes - i < 3 || advanced){
           outpred += CalculateTreeSize(ll_lengths, d_lengths, hq, &best);
         }
@@ -1026,7 +1153,7 @@ static void AddLZ77Block(int btype, int final,
 
   if (btype == 2){
     if(advanced){
-      outpred = *outsize * 8 + *bp -((*bp != 0) * 8) + GetAdvancedLengths(litlens, dists, 0, lend, ll_lengths, d_lengths, 0);
+      outpred = *outsize * 8 + *bp -((*bp != 0) * 8) + GetAdvancedLengths(tokens, 0, lend, ll_lengths, d_lengths);
       outpred += CalculateTreeSize(ll_lengths, d_lengths, 2, &best);
     }
     PatchDistanceCodesForBuggyDecoders(d_lengths);
@@ -1036,7 +1163,7 @@ static void AddLZ77Block(int btype, int final,
   }
   ZopfliLengthsToSymbols(ll_lengths, 288, 15, ll_symbols);
   ZopfliLengthsToSymbols(d_lengths, 32, 15, d_symbols);
-  AddLZ77Data(litlens, dists, 0, lend
+  AddLZ77Data(tokens, 0, lend
               , expected_data_size
               , ll_symbols, ll_lengths, d_symbols, d_lengths,
               bp, *out, outsize);
@@ -1047,8 +1174,7 @@ static void AddLZ77Block(int btype, int final,
     assert(outpred == *outsize * 8 + *bp - (*bp != 0) * 8);
   }
   if (replaceCodes){
-    free(litlens);
-    free(dists);
+    free(tokens);
   }
 }
 
@@ -1078,8 +1204,8 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
     ZopfliLZ77Store fixedstore;
     ZopfliInitLZ77Store(&fixedstore);
     ZopfliLZ77OptimalFixed(options, in, instart, inend, &fixedstore, 0);
-    double dyncost = ZopfliCalculateBlockSize(store.litlens, store.dists, 0, store.size, 2, options->searchext, store.symbols);
-    double fixedcost = ZopfliCalculateBlockSize(fixedstore.litlens, fixedstore.dists, 0, fixedstore.size, 1, options->searchext, store.symbols);
+    double dyncost = ZopfliCalculateBlockSize(store.tokens, 0, store.size, 2, options->searchext);
+    double fixedcost = ZopfliCalculateBlockSize(fixedstore.tokens, 0, fixedstore.size, 1, options->searchext);
     if (fixedcost <= dyncost) {
       btype = 1;
       ZopfliCleanLZ77Store(&store);
@@ -1090,15 +1216,15 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
   }
 
   if (twiceMode & 1){
-    ZopfliInitLZ77Store(twiceStore);
-    twiceStore->dists = store.dists;
-    twiceStore->litlens = store.litlens;
-    twiceStore->size = store.size;
+    *twiceStore = store;
   }
   else{
+    size_t before = *outsize;
+    double timing = TimingStart();
     AddLZ77Block(btype, final,
-                 store.litlens, store.dists, store.size,
+                 store.tokens, store.size,
                  blocksize, bp, out, outsize, options->searchext, in, instart, options->replaceCodes, options->advanced);
+    TimingStage("encode", timing, blocksize, *outsize - before);
 
     if (!options->replaceCodes){
       ZopfliCleanLZ77Store(&store);
@@ -1115,48 +1241,37 @@ struct BlockData {
   SymbolStats* statsp;
 };
 
-static void DeflateDynamicBlock2(const ZopfliOptions* options, const unsigned char* in,
-                                 BlockData** instore, BlockData* blockend, std::mutex& mtx) {
-  for(;;) {
-    mtx.lock();
-    BlockData* store = *instore;
-    if(store == blockend){
-      mtx.unlock();
-      return;
-    }
-    (*instore)++;
-    mtx.unlock();
-    size_t instart = store->start;
-    size_t inend = store->end;
-    size_t blocksize = inend - instart;
-    store->btype = 2;
+static void DeflateDynamicBlock2(const ZopfliOptions* options, const unsigned char* in, BlockData* store) {
+  size_t instart = store->start;
+  size_t inend = store->end;
+  size_t blocksize = inend - instart;
+  store->btype = 2;
 
-    ZopfliInitLZ77Store(&store->store);
+  ZopfliInitLZ77Store(&store->store);
 
-    if (blocksize <= options->skipdynamic){
-      store->btype = 1;
-      ZopfliLZ77OptimalFixed(options, in, instart, inend, &store->store, 0);
-    }
-    else{
-      ZopfliLZ77Optimal2(options, in, instart, inend, &store->store, 1, store->statsp, 0);
-    }
+  if (blocksize <= options->skipdynamic){
+    store->btype = 1;
+    ZopfliLZ77OptimalFixed(options, in, instart, inend, &store->store, 0);
+  }
+  else{
+    ZopfliLZ77Optimal2(options, in, instart, inend, &store->store, 1, store->statsp, 0);
+  }
 
-    /* For small block, encoding with fixed tree can be smaller. For large block,
-     don't bother doing this expensive test, dynamic tree will be better.*/
-    if (blocksize > options->skipdynamic && store->store.size < options->trystatic){
-      double dyncost, fixedcost;
-      ZopfliLZ77Store fixedstore;
-      ZopfliInitLZ77Store(&fixedstore);
-      ZopfliLZ77OptimalFixed(options, in, instart, inend, &fixedstore, 0);
-      dyncost = ZopfliCalculateBlockSize(store->store.litlens, store->store.dists, 0, store->store.size, 2, options->searchext, store->store.symbols);
-      fixedcost = ZopfliCalculateBlockSize(fixedstore.litlens, fixedstore.dists, 0, fixedstore.size, 1, options->searchext, fixedstore.symbols);
-      if (fixedcost <= dyncost) {
-        store->btype = 1;
-        ZopfliCleanLZ77Store(&store->store);
-        store->store = fixedstore;
-      } else {
-        ZopfliCleanLZ77Store(&fixedstore);
-      }
+  /* For small block, encoding with fixed tree can be smaller. For large block,
+   don't bother doing this expensive test, dynamic tree will be better.*/
+  if (blocksize > options->skipdynamic && store->store.size < options->trystatic){
+    double dyncost, fixedcost;
+    ZopfliLZ77Store fixedstore;
+    ZopfliInitLZ77Store(&fixedstore);
+    ZopfliLZ77OptimalFixed(options, in, instart, inend, &fixedstore, 0);
+    dyncost = ZopfliCalculateBlockSize(store->store.tokens, 0, store->store.size, 2, options->searchext);
+    fixedcost = ZopfliCalculateBlockSize(fixedstore.tokens, 0, fixedstore.size, 1, options->searchext);
+    if (fixedcost <= dyncost) {
+      store->btype = 1;
+      ZopfliCleanLZ77Store(&store->store);
+      store->store = fixedstore;
+    } else {
+      ZopfliCleanLZ77Store(&fixedstore);
     }
   }
 }
@@ -1171,11 +1286,6 @@ static void DeflateSplittingFirst2(
   size_t mnext = msize;
   unsigned numblocks = npoints + 1;
 
-  unsigned threads = options->multithreading;
-  if(threads > numblocks){
-    threads = numblocks;
-  }
-  std::vector<std::thread> multi (threads);
   std::vector<BlockData> d (numblocks);
   size_t i;
 
@@ -1184,29 +1294,31 @@ static void DeflateSplittingFirst2(
     d[i].end = i == npoints ? inend : splitpoints[i];
     d[i].statsp = &statsp[i];
   }
-  BlockData* data = &d[0];
-  BlockData* blockend = data + numblocks;
-  std::mutex mtx;
-  for (i = 0; i < threads; i++) {
-    multi[i] = std::thread(DeflateDynamicBlock2,options, in, &data, blockend, std::ref(mtx));
-  }
-  for(std::thread& t : multi) {
-    t.join();
+  /* Blocks go to the shared pool, so threads that ran out of files can help. */
+  TaskGroup group;
+  for (i = 0; i < numblocks; i++) {
+    BlockData* block = &d[i];
+    group.Run([options, in, block]{DeflateDynamicBlock2(options, in, block);});
   }
+  group.Wait();
 
   if (twiceMode & 1){
     unsigned j = 0;
 
     for(;;){
       ZopfliInitLZ77Store(twiceStore);
+      /* Size the master block's store once instead of growing it per block. */
+      size_t total = 0;
+      for (size_t k = j; k < numblocks; k++){
+        total += d[k].store.size;
+        if(d[k].end == mnext){
+          break;
+        }
+      }
+      ZopfliLZ77StoreReserve(twiceStore, total);
       for(; j < numblocks; j++){
-        twiceStore->litlens = (unsigned short*)realloc(twiceStore->litlens, sizeof(unsigned short) * (twiceStore->size + d[j].store.size));
-        twiceStore->dists = (unsigned short*)realloc(twiceStore->dists, sizeof(unsigned short) * (twiceStore->size + d[j].store.size));
-        memcpy(twiceStore->litlens + twiceStore->size, d[j].store.litlens, d[j].store.size * sizeof(unsigned short));
-        memcpy(twiceStore->dists + twiceStore->size, d[j].store.dists, d[j].store.size * sizeof(unsigned short));
-        free(d[j].store.dists);
-        free(d[j].store.litlens);
-        twiceStore->size += d[j].store.size;
+        ZopfliAppendLZ77Store(&d[j].store, twiceStore);
+        ZopfliCleanLZ77Store(&d[j].store);
         if(d[j].end == mnext){
           mnext += msize;
           j++;
@@ -1225,9 +1337,12 @@ static void DeflateSplittingFirst2(
       size_t start = i == 0 ? 0 : splitpoints[i - 1];
       size_t end = i == npoints ? inend : splitpoints[i];
 
+      size_t before = *outsize;
+      double timing = TimingStart();
       AddLZ77Block(d[i].btype, i == npoints && final,
-                   d[i].store.litlens, d[i].store.dists, d[i].store.size,
+                   d[i].store.tokens, d[i].store.size,
                    end - start, bp, out, outsize, options->searchext, in, start, options->replaceCodes, options->advanced);
+      TimingStage("encode", timing, end - start, *outsize - before);
       if (!options->replaceCodes){
         ZopfliCleanLZ77Store(&d[i].store);
       }
@@ -1238,6 +1353,15 @@ static void DeflateSplittingFirst2(
   free(statsp);
 }
 
+/* Block splitting result of one master block in ZopfliDeflateMulti. */
+struct MasterSplit {
+  size_t start;
+  size_t size;
+  size_t* splitpoints;
+  size_t npoints;
+  SymbolStats* stats;
+};
+
 static void ZopfliDeflateMulti(const ZopfliOptions* options, int final,
                                const unsigned char* in, const size_t insize,
                                unsigned char* bp, unsigned char** out, size_t* outsize){
@@ -1246,8 +1370,10 @@ static void ZopfliDeflateMulti(const ZopfliOptions* options, int final,
   if (!options->isPNG && options->numiterations == 1){
     msize /= 5;
   }
+  ThreadPoolInit(options->multithreading);
   ZopfliLZ77Store* lf = 0;//!
   ZopfliLZ77Store dummy;
+  ZopfliInitLZ77Store(&dummy);
   if(options->twice){
     lf = (ZopfliLZ77Store*)malloc(((insize / msize) + 1) * sizeof(ZopfliLZ77Store));
     if(!lf){
@@ -1261,22 +1387,51 @@ static void ZopfliDeflateMulti(const ZopfliOptions* options, int final,
     size_t* splitpoints = 0;
     SymbolStats* stats = 0;
 
-    unsigned mblocks = 0;
+    std::vector<MasterSplit> m;
     while (i < insize) {
       if(it == 0 && options->twice){
-        ZopfliInitLZ77Store(lf + mblocks);
+        ZopfliInitLZ77Store(lf + m.size());
       }
 
       int masterfinal = (i + msize >= insize);
       size_t size = masterfinal ? insize - i : msize;
-      ZopfliBlockSplit(options, in, i, i + size, &splitpoints, &npoints, &stats, 1 + (!!it), it ? lf[mblocks] : dummy);
-      if(i + size < insize){
-        ZOPFLI_APPEND_DATA(i + size, &splitpoints, &npoints);
-      }
-      mblocks++;
+      m.push_back(MasterSplit{i, size, 0, 0, 0});
       i += size;
     }
 
+    /* Master blocks are split independently, so this runs on the pool too. */
+    TaskGroup group;
+    for (size_t j = 0; j < m.size(); j++) {
+      MasterSplit* master = &m[j];
+      ZopfliLZ77Store twiceStore = it ? lf[j] : dummy;
+      group.Run([options, in, master, it, twiceStore]{
+        double timing = TimingStart();
+        ZopfliBlockSplit(options, in, master->start, master->start + master->size, &master->splitpoints, &master->npoints, &master->stats, 1 + (!!it), twiceStore);
+        TimingStage("split", timing, master->size, 0);
+      });
+    }
+    group.Wait();
+
+    size_t nblocks = 0;
+    for (size_t j = 0; j < m.size(); j++) {
+      nblocks += m[j].npoints + 1;
+    }
+    stats = (SymbolStats*)malloc(nblocks * sizeof(SymbolStats));
+    if (!stats){
+      exit(1);
+    }
+    for (size_t j = 0; j < m.size(); j++) {
+      memcpy(stats + npoints, m[j].stats, (m[j].npoints + 1) * sizeof(SymbolStats));
+      for (size_t k = 0; k < m[j].npoints; k++){
+        ZOPFLI_APPEND_DATA(m[j].splitpoints[k], &splitpoints, &npoints);
+      }
+      if(j + 1 < m.size()){
+        ZOPFLI_APPEND_DATA(m[j].start + m[j].size, &splitpoints, &npoints);
+      }
+      free(m[j].splitpoints);
+      free(m[j].stats);
+    }
+
     DeflateSplittingFirst2(options, final, in, insize, bp,
                            out, outsize, npoints, splitpoints, stats,
                            options->twice && it != options->twice, lf, msize);
@@ -1301,7 +1456,9 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
   size_t* splitpoints = 0;
   size_t npoints = 0;
   SymbolStats* statsp = 0;
+  double timing = TimingStart();
   ZopfliBlockSplit(options, in, instart, inend, &splitpoints, &npoints, &statsp, twiceMode, *twiceStore);
+  TimingStage("split", timing, inend - instart, 0);
 
   ZopfliLZ77Store* stores = 0;
   if (twiceMode & 1){
@@ -1319,14 +1476,14 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
   }
   if (twiceMode & 1){
     ZopfliInitLZ77Store(twiceStore);
+    size_t total = 0;
     for(size_t i = 0; i < npoints + 1; i++){
-      twiceStore->litlens = (unsigned short*)realloc(twiceStore->litlens, sizeof(unsigned short) * (twiceStore->size + stores->size));
-      twiceStore->dists = (unsigned short*)realloc(twiceStore->dists, sizeof(unsigned short) * (twiceStore->size + stores->size));
-      memcpy(twiceStore->litlens + twiceStore->size, stores->litlens, stores->size * sizeof(unsigned short));
-      memcpy(twiceStore->dists + twiceStore->size, stores->dists, stores->size * sizeof(unsigned short));
-      free(stores->dists);
-      free(stores->litlens);
-      twiceStore->size += stores->size;
+      total += stores[i].size;
+    }
+    ZopfliLZ77StoreReserve(twiceStore, total);
+    for(size_t i = 0; i < npoints + 1; i++){
+      ZopfliAppendLZ77Store(stores, twiceStore);
+      ZopfliCleanLZ77Store(stores);
       stores++;
     }
     free(stores - (npoints + 1));
@@ -1363,6 +1520,9 @@ void ZopfliDeflate(const ZopfliOptions* options, int final,
     AddBits(0, 7, bp, *out, outsize);
     return;
   }
+  if (options->matchcache){
+    ZopfliMatchCacheReserve(insize);
+  }
 #ifndef NOMULTI
   if(options->multithreading > 1 && insize >= options->noblocksplit){
     ZopfliDeflateMulti(options, final, in, insize, bp, out, outsize);
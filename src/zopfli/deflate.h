@@ -58,14 +58,12 @@ void ZopfliDeflate(const ZopfliOptions* options, int final,
 
 /*
 Calculates block size in bits.
-litlens: lz77 lit/lengths
-dists: ll77 distances
+tokens: lz77 tokens, see ZopfliLZ77Store
 lstart: start of block
 lend: end of block (not inclusive)
 */
-double ZopfliCalculateBlockSize(const unsigned short* litlens,
-                                const unsigned short* dists,
-                                size_t lstart, size_t lend, int btype, unsigned char hq, unsigned char symbols);
+double ZopfliCalculateBlockSize(const unsigned* tokens,
+                                size_t lstart, size_t lend, int btype, unsigned char hq);
 
 void OptimizeHuffmanCountsForRle(int length, size_t* counts);
 size_t GetDynamicLengthsuse(unsigned* ll_lengths, unsigned* d_lengths, const size_t* ll_counts, const size_t* d_counts);
@@ -119,15 +119,72 @@ static void ExtractBitLengths(Node* chain, Node* leaves, unsigned* bitlengths) {
   }
 }
 
-void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
-  int i;
-  int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
+/*
+Computes unlimited Huffman code lengths in place, following "In-Place
+Calculation of Minimum-Redundancy Codes" by Moffat and Katajainen. On input A
+holds the n >= 2 weights sorted from lightest to heaviest, on output the code
+length of each of them. Internal nodes win ties against leaves, as in the
+package-merge below, so both produce the same lengths whenever the limit does
+not bind. Returns the longest code length.
+*/
+static unsigned HuffmanInPlace(size_t* A, int n) {
+  int root = 0;
+  int leaf = 2;
+  int next;
+  A[0] += A[1];
+  for (next = 1; next < n - 1; next++) {
+    /* First child. */
+    if (leaf >= n || A[root] <= A[leaf]) {
+      A[next] = A[root];
+      A[root++] = next;
+    } else {
+      A[next] = A[leaf++];
+    }
+    /* Second child. */
+    if (leaf >= n || (root < next && A[root] <= A[leaf])) {
+      A[next] += A[root];
+      A[root++] = next;
+    } else {
+      A[next] += A[leaf++];
+    }
+  }
 
-  /* Array of lists of chains. Each list requires only two lookahead chains at
-  a time, so each list is a array of two Node*'s. */
+  /* Convert parent pointers to internal node depths. */
+  A[n - 2] = 0;
+  for (next = n - 3; next >= 0; next--) {
+    A[next] = A[A[next]] + 1;
+  }
 
-  /* One leaf per symbol. Only numsymbols leaves will be used. */
-  Node leaves[288];
+  /* Convert internal node depths to leaf depths. */
+  int avbl = 1;
+  int used = 0;
+  unsigned depth = 0;
+  root = n - 2;
+  next = n - 1;
+  while (avbl > 0) {
+    while (root >= 0 && A[root] == depth) {
+      used++;
+      root--;
+    }
+    while (avbl > used) {
+      A[next--] = depth;
+      avbl--;
+    }
+    avbl = 2 * used;
+    depth++;
+    used = 0;
+  }
+  return A[0];
+}
+
+/*
+Places the symbols with nonzero frequency in leaves, sorted from lightest to
+heaviest, and handles the cases with at most two symbols. Returns the amount
+of leaves that still need a code, or 0 if bitlengths is already final.
+*/
+static int SortLeaves(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths, Node* leaves) {
+  int i;
+  int numsymbols = 0;  /* Amount of symbols with frequency > 0. */
 
   /* Initialize all bitlengths at 0. */
   memset(bitlengths, 0, n * sizeof(unsigned));
@@ -144,16 +201,16 @@ void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbit
   /* Check special cases and error conditions. */
   assert((1 << maxbits) >= numsymbols); /* Error, too few maxbits to represent symbols. */
   if (numsymbols == 0) {
-    return;  /* No symbols at all. OK. */
+    return 0;  /* No symbols at all. OK. */
   }
   if (numsymbols == 1) {
     bitlengths[leaves[0].count] = 1;
-    return;  /* Only one symbol, give it bitlength 1, not 0. OK. */
+    return 0;  /* Only one symbol, give it bitlength 1, not 0. OK. */
   }
   if (numsymbols == 2){
     bitlengths[leaves[0].count]++;
     bitlengths[leaves[1].count]++;
-    return;
+    return 0;
   }
 
   struct {
@@ -167,10 +224,20 @@ void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbit
     leaves[i].weight = (leaves[i].weight << 9) | leaves[i].count;
   }
   std::sort(leaves, leaves + numsymbols, cmp);
-
   for (i = 0; i < numsymbols; i++) {
     leaves[i].weight >>= 9;
   }
+  return numsymbols;
+}
+
+/*
+Runs boundary package-merge on numsymbols >= 3 sorted leaves.
+*/
+static void PackageMerge(Node* leaves, int numsymbols, int maxbits, unsigned* bitlengths) {
+  int i;
+
+  /* Array of lists of chains. Each list requires only two lookahead chains at
+  a time, so each list is a array of two Node*'s. */
 
   if (numsymbols - 1 < maxbits) {
     maxbits = numsymbols - 1;
@@ -246,3 +313,35 @@ void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbit
 
   ExtractBitLengths(lists[maxbits - 1][1], leaves, bitlengths);
 }
+
+void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+  /* One leaf per symbol. Only numsymbols leaves will be used. */
+  Node leaves[288];
+  int numsymbols = SortLeaves(frequencies, n, maxbits, bitlengths, leaves);
+  if (!numsymbols) {
+    return;
+  }
+
+  size_t depths[288];
+  for (int i = 0; i < numsymbols; i++) {
+    depths[i] = leaves[i].weight;
+  }
+
+  /* Most histograms fit the limit without help, so only run package-merge when
+  the unlimited code is too deep. */
+  if (HuffmanInPlace(depths, numsymbols) <= (unsigned)maxbits) {
+    for (int i = 0; i < numsymbols; i++) {
+      bitlengths[leaves[i].count] = depths[i];
+    }
+    return;
+  }
+  PackageMerge(leaves, numsymbols, maxbits, bitlengths);
+}
+
+void ZopfliPackageMergeCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths) {
+  Node leaves[288];
+  int numsymbols = SortLeaves(frequencies, n, maxbits, bitlengths, leaves);
+  if (numsymbols) {
+    PackageMerge(leaves, numsymbols, maxbits, bitlengths);
+  }
+}
@@ -44,6 +44,13 @@ return: 0 for OK, non-0 for error.
 */
 void ZopfliLengthLimitedCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths);
 
+/*
+Same as ZopfliLengthLimitedCodeLengths, but always uses boundary package-merge
+instead of trying the in-place Huffman construction first. Slower; kept as the
+reference the tests compare against.
+*/
+void ZopfliPackageMergeCodeLengths(const size_t* frequencies, int n, int maxbits, unsigned* bitlengths);
+
 #ifdef __cplusplus
 }
 #endif
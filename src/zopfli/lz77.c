@@ -38,39 +38,46 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #endif
 
 void ZopfliInitLZ77Store(ZopfliLZ77Store* store) {
+  store->tokens = 0;
   store->size = 0;
-  store->litlens = 0;
-  store->dists = 0;
-  store->symbols = 0;
+  store->allocsize = 0;
 }
 
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store) {
-  free(store->litlens);
-  free(store->dists);
+  free(store->tokens);
 }
 
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
   ZopfliCleanLZ77Store(dest);
-  dest->litlens = (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
-  dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
-
-  if (!dest->litlens || !dest->dists) exit(1); /* Allocation failed. */
+  ZopfliInitLZ77Store(dest);
+  ZopfliAppendLZ77Store(source, dest);
+}
 
-  dest->size = source->size;
+void ZopfliLZ77StoreReserve(ZopfliLZ77Store* store, size_t count) {
+  if (store->size + count <= store->allocsize) return;
+  size_t allocsize = store->allocsize * 2;
+  if (allocsize < store->size + count) allocsize = store->size + count;
+  store->tokens = (unsigned*)realloc(store->tokens, allocsize * sizeof(*store->tokens));
+  if (!store->tokens) exit(1); /* Allocation failed. */
+  store->allocsize = allocsize;
+}
 
-  memcpy(dest->litlens, source->litlens, source->size * sizeof(*dest->dists));
-  memcpy(dest->dists, source->dists, source->size * sizeof(*dest->dists));
+void ZopfliAppendLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
+  if (!source->size) return;
+  ZopfliLZ77StoreReserve(dest, source->size);
+  memcpy(dest->tokens + dest->size, source->tokens, source->size * sizeof(*dest->tokens));
+  dest->size += source->size;
 }
 
 /*
-Appends the length and distance to the LZ77 arrays of the ZopfliLZ77Store.
-context must be a ZopfliLZ77Store*.
+Appends the literal (dist 0) or length and distance to the ZopfliLZ77Store.
 */
-static void ZopfliStoreLitLenDist(unsigned short length, unsigned char dist,
+static void ZopfliStoreLitLenDist(unsigned short length, unsigned short dist,
                            ZopfliLZ77Store* store) {
-  size_t size2 = store->size;  /* Needed for using ZOPFLI_APPEND_DATA twice. */
-  ZOPFLI_APPEND_DATA(length, &store->litlens, &store->size);
-  ZOPFLI_APPEND_DATA(dist, (unsigned char**)&store->dists, &size2);
+  if (store->size == store->allocsize) {
+    ZopfliLZ77StoreReserve(store, store->allocsize ? store->allocsize : 1024);
+  }
+  store->tokens[store->size++] = ZopfliLZ77Token(length, dist);
 }
 
 #ifndef NDEBUG
@@ -83,16 +90,6 @@ void ZopfliVerifyLenDist(const unsigned char* data, size_t datasize, size_t pos,
 }
 #endif
 
-static unsigned symtox(unsigned lls){
-  if (lls <= 279){
-    return 0;
-  }
-  if (lls <= 283){
-    return 100;
-  }
-  return 200;
-}
-
 /*
  LZ4 HC - High Compression Mode of LZ4
  Copyright (C) 2011-2015, Yann Collet.
@@ -318,7 +315,7 @@ size_t ZopfliLZ77LazyLauncher(const unsigned char* in,
   ZopfliLZ77Lazy(&options, in,
                  instart, inend,
                  &store);
-  size_t ret = ZopfliCalculateBlockSize(store.litlens, store.dists, 0, store.size, 2, 0, 1);
+  size_t ret = ZopfliCalculateBlockSize(store.tokens, 0, store.size, 2, 0);
   ZopfliCleanLZ77Store(&store);
   return ret;
 }
@@ -376,13 +373,12 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
         ZopfliStoreLitLenDist(in[i - 1], 0, store);
         match_available = 0;
       }
-      unsigned lls = ZopfliGetLengthSymbol(leng);
-      ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+      ZopfliStoreLitLenDist(leng, dist, store);
       i += (leng - 1);
       if (dist == 1) {
         i++;
         while (i + ZOPFLI_MAX_MATCH <= inend && memcmp(&in[i], &in[i - 1], ZOPFLI_MAX_MATCH) == 0) {
-          ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+          ZopfliStoreLitLenDist(leng, dist, store);
           i += leng;
         }
         i--;
@@ -406,8 +402,7 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
         ZopfliVerifyLenDist(in, inend, i - 1, dist, leng);
 #endif
 
-        unsigned lls = ZopfliGetLengthSymbol(leng);
-        ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+        ZopfliStoreLitLenDist(leng, dist, store);
         i += leng - 2;
         continue;
       }
@@ -423,154 +418,107 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
 #ifndef NDEBUG
     ZopfliVerifyLenDist(in, inend, i, dist, leng);
 #endif
-    unsigned lls = ZopfliGetLengthSymbol(leng);
-    ZopfliStoreLitLenDist(lls + ((leng - symtox(lls)) << 9), ZopfliGetDistSymbol(dist) + 1, store);
+    ZopfliStoreLitLenDist(leng, dist, store);
     i += leng - 1;
   }
 }
 
-void ZopfliLZ77Counts(const unsigned short* litlens, const unsigned short* dists, size_t start, size_t end, size_t* ll_count, size_t* d_count, unsigned char symbols) {
-  for (unsigned i = 0; i < 288; i++) {
+/*
+Counts the symbols from start to end like ZopfliLZ77Counts, but without the end
+symbol.
+*/
+static void LZ77CountRange(const unsigned* tokens, size_t start, size_t end, size_t* ll_count, size_t* d_count) {
+  /* Four interleaved sub-histograms per alphabet, so consecutive increments of
+  the same symbol don't wait for each other. Distance symbols are counted one
+  place up, literals land in entry 0. */
+  size_t ll_count1[288] = {0};
+  size_t ll_count2[288] = {0};
+  size_t ll_count3[288] = {0};
+  size_t d_count0[32] = {0};
+  size_t d_count1[32] = {0};
+  size_t d_count2[32] = {0};
+  size_t d_count3[32] = {0};
+  size_t i;
+  for (i = 0; i < 288; i++) {
     ll_count[i] = 0;
   }
-  for (unsigned i = 0; i < 32; i++) {
-    d_count[i] = 0;
-  }
-  ll_count[256] = 1;  /* End symbol. */
-
-  size_t i;
-
-  if (symbols){
-#if defined(__GNUC__) && (defined(__x86_64__) || defined(_M_X64))
-    size_t d_count1[32] = {0};
-    size_t d_count2[32] = {0};
-    size_t d_count3[32] = {0};
-
-    const unsigned char* distc = (const unsigned char*)dists;
-
-    size_t rstart = start + ((end - start) & 15);
-
-    for (i = start; i < rstart; i++) {
-      d_count[distc[i]]++;
-      ll_count[litlens[i] & 511]++;
-    }
-
-#define ANDLLS (511LLU + (511LLU << 16) + (511LLU << 32) + (511LLU << 48))
-    const unsigned char* ipo = &distc[rstart];
-    while (ipo < distc + end)
-    {
-      size_t c = *(size_t*)ipo; ipo += 8;
-      size_t c1 = *(size_t*)ipo; ipo += 8;
-      d_count[(unsigned char) c     ]++;
-      d_count1[(unsigned char)(c>>8) ]++;
-      d_count2[(unsigned char)(c>>16)]++;
-      d_count3[(unsigned char)(c>>24) ]++;
-      d_count[(unsigned char) (c>>32)    ]++;
-      d_count1[(unsigned char)(c>>40) ]++;
-      d_count2[(unsigned char)(c>>48)]++;
-      d_count3[       (c>>56) ]++;
-
-      d_count[(unsigned char) c1     ]++;
-      d_count1[(unsigned char)(c1>>8) ]++;
-      d_count2[(unsigned char)(c1>>16)]++;
-      d_count3[(unsigned char)(c1>>24) ]++;
-      d_count[(unsigned char) (c1>>32)    ]++;
-      d_count1[(unsigned char)(c1>>40) ]++;
-      d_count2[(unsigned char)(c1>>48)]++;
-      d_count3[       (c1>>56) ]++;
-    }
-
-    for (i = 0; i < 32; i++){
-      d_count[i] += d_count1[i] + d_count2[i] + d_count3[i];
-    }
-    for (i = 0; i < 31; i++) {
-      d_count[i] = d_count[i + 1];
-    }
-
-    size_t ll_count1[288] = {0};
-    size_t ll_count2[288] = {0};
-    size_t ll_count3[288] = {0};
-
-    const unsigned short* ip = &litlens[rstart];
-    while (ip < litlens + end)
-    {
-      size_t c = (*(size_t*)ip) & ANDLLS; ip += 4;
-      size_t c1 = (*(size_t*)ip) & ANDLLS; ip += 4;
-
-      ll_count[(unsigned short) c     ]++;
-      ll_count1[(unsigned short)(c>>16) ]++;
-      ll_count2[(unsigned short)(c>>32)]++;
-      ll_count3[       c>>48 ]++;
-
-      ll_count[(unsigned short) c1     ]++;
-      ll_count1[(unsigned short)(c1>>16) ]++;
-      ll_count2[(unsigned short)(c1>>32)]++;
-      ll_count3[       c1>>48 ]++;
-
-      c = (*(size_t*)ip) & ANDLLS; ip += 4;
-      c1 = (*(size_t*)ip) & ANDLLS; ip += 4;
-
-      ll_count[(unsigned short) c     ]++;
-      ll_count1[(unsigned short)(c>>16) ]++;
-      ll_count2[(unsigned short)(c>>32)]++;
-      ll_count3[       c>>48 ]++;
-
-      ll_count[(unsigned short) c1     ]++;
-      ll_count1[(unsigned short)(c1>>16) ]++;
-      ll_count2[(unsigned short)(c1>>32)]++;
-      ll_count3[       c1>>48 ]++;
-    }
-
-    for (i = 0; i < 288; i++){
-      ll_count[i] += ll_count1[i] + ll_count2[i] + ll_count3[i];
-    }
-#else
-
-    const unsigned char* distc = (const unsigned char*)dists;
-    for (i = start; i < end; i++) {
-      d_count[distc[i]]++;
-    }
 
-    for (i = 0; i < 31; i++) {
-      d_count[i] = d_count[i + 1];
-    }
+  size_t rstart = start + ((end - start) & 7);
+  for (i = start; i < rstart; i++) {
+    ll_count[ZOPFLI_TOKEN_LLSYMBOL(tokens[i])]++;
+    d_count0[ZOPFLI_TOKEN_DSYMBOL1(tokens[i])]++;
+  }
 
-    for (i = start; i < end; i++) {
-      ll_count[litlens[i] & 511]++;
-    }
-#endif
+  const unsigned* ip = &tokens[rstart];
+  while (ip < tokens + end) {
+    unsigned t = ip[0];
+    unsigned t1 = ip[1];
+    unsigned t2 = ip[2];
+    unsigned t3 = ip[3];
+    ll_count[ZOPFLI_TOKEN_LLSYMBOL(t)]++;
+    ll_count1[ZOPFLI_TOKEN_LLSYMBOL(t1)]++;
+    ll_count2[ZOPFLI_TOKEN_LLSYMBOL(t2)]++;
+    ll_count3[ZOPFLI_TOKEN_LLSYMBOL(t3)]++;
+    d_count0[ZOPFLI_TOKEN_DSYMBOL1(t)]++;
+    d_count1[ZOPFLI_TOKEN_DSYMBOL1(t1)]++;
+    d_count2[ZOPFLI_TOKEN_DSYMBOL1(t2)]++;
+    d_count3[ZOPFLI_TOKEN_DSYMBOL1(t3)]++;
+
+    t = ip[4];
+    t1 = ip[5];
+    t2 = ip[6];
+    t3 = ip[7];
+    ll_count[ZOPFLI_TOKEN_LLSYMBOL(t)]++;
+    ll_count1[ZOPFLI_TOKEN_LLSYMBOL(t1)]++;
+    ll_count2[ZOPFLI_TOKEN_LLSYMBOL(t2)]++;
+    ll_count3[ZOPFLI_TOKEN_LLSYMBOL(t3)]++;
+    d_count0[ZOPFLI_TOKEN_DSYMBOL1(t)]++;
+    d_count1[ZOPFLI_TOKEN_DSYMBOL1(t1)]++;
+    d_count2[ZOPFLI_TOKEN_DSYMBOL1(t2)]++;
+    d_count3[ZOPFLI_TOKEN_DSYMBOL1(t3)]++;
+    ip += 8;
+  }
 
-    return;
+  for (i = 0; i < 288; i++) {
+    ll_count[i] += ll_count1[i] + ll_count2[i] + ll_count3[i];
+  }
+  for (i = 0; i < 31; i++) {
+    d_count[i] = d_count0[i + 1] + d_count1[i + 1] + d_count2[i + 1] + d_count3[i + 1];
   }
+  d_count[31] = 0;
+}
 
-  size_t lenarrything[515] = {0};
-  size_t lenarrything2[515] = {0};
-  size_t d_count2[64] = {0};
+void ZopfliLZ77Counts(const unsigned* tokens, size_t start, size_t end, size_t* ll_count, size_t* d_count) {
+  LZ77CountRange(tokens, start, end, ll_count, d_count);
+  ll_count[256] = 1;  /* End symbol. */
+}
 
-  size_t* dc = d_count2 + 1;
-  size_t* dc2 = d_count2 + 32;
+void ZopfliLZ77HistogramClear(ZopfliLZ77Histogram* h) {
+  memset(h, 0, sizeof(*h));
+}
 
-  if ((end - start) % 2){
-    lenarrything[litlens[start] + !dists[start] * 259]++;
-    dc[ZopfliGetDistSymbol(dists[start])]++;
-    start++;
-  }
-  for (i = start; i < end; i++) {
-    lenarrything[litlens[i] + !dists[i] * 259]++;
-    dc[ZopfliGetDistSymbol(dists[i])]++;
-    i++;
-    lenarrything2[litlens[i] + !dists[i] * 259]++;
-    dc2[ZopfliGetDistSymbol(dists[i])]++;
+void ZopfliLZ77HistogramAddRange(ZopfliLZ77Histogram* h, const unsigned* tokens, size_t start, size_t end) {
+  if (start >= end) return;
+  size_t ll_count[288];
+  size_t d_count[32];
+  LZ77CountRange(tokens, start, end, ll_count, d_count);
+  for (unsigned i = 0; i < 288; i++) {
+    h->ll_count[i] += ll_count[i];
   }
-
-  for (i = 0; i < 256; i++){
-    ll_count[i] = lenarrything[i + 259] + lenarrything2[i + 259];
+  for (unsigned i = 0; i < 32; i++) {
+    h->d_count[i] += d_count[i];
   }
+}
 
-  for (i = 3; i < 259; i++){
-    ll_count[ZopfliGetLengthSymbol(i)] += lenarrything[i] + lenarrything2[i];
+void ZopfliLZ77HistogramSubtractRange(ZopfliLZ77Histogram* h, const unsigned* tokens, size_t start, size_t end) {
+  if (start >= end) return;
+  size_t ll_count[288];
+  size_t d_count[32];
+  LZ77CountRange(tokens, start, end, ll_count, d_count);
+  for (unsigned i = 0; i < 288; i++) {
+    h->ll_count[i] -= ll_count[i];
   }
-  for (i = 0; i < 30; i++){
-    d_count[i] = dc[i] + dc2[i];
+  for (unsigned i = 0; i < 32; i++) {
+    h->d_count[i] -= d_count[i];
   }
 }
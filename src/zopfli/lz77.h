@@ -28,33 +28,78 @@ compression.
 #define ZOPFLI_LZ77_H_
 
 #include "zopfli.h"
+#include "util.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /*
-Stores lit/length and dist pairs for LZ77.
-Parameter litlens: Contains the literal symbols or length values.
-Parameter dists: Contains the distances. A value is 0 to indicate that there is
-no dist and the corresponding litlens value is a literal instead of a length.
-Parameter size: The size of both the litlens and dists arrays.
+Stores lit/length and dist pairs for LZ77, one packed 32-bit token per pair
+with the DEFLATE symbols already resolved, so that counting, cost and output
+don't need to look them up again:
+bits 0-8: literal or length symbol
+bits 9-13: value of the length extra bits
+bits 14-18: dist symbol + 1, or 0 if the token is a literal
+bits 19-31: value of the dist extra bits
+Parameter tokens: The tokens.
+Parameter size: The amount of tokens.
+Parameter allocsize: The amount of tokens that fit in the allocation of tokens.
 The memory can best be managed by using ZopfliInitLZ77Store to initialize it
 and ZopfliCleanLZ77Store to destroy it.
-
 */
 typedef struct ZopfliLZ77Store {
-  unsigned short* litlens;  /* Lit or len. */
-  unsigned short* dists;  /* If 0: indicates literal in corresponding litlens,
-      if > 0: length in corresponding litlens, this is the distance. */
+  unsigned* tokens;
   size_t size;
-  unsigned char symbols;
+  size_t allocsize;
 } ZopfliLZ77Store;
 
+#define ZOPFLI_TOKEN_LLSYMBOL(token) ((token) & 511)
+#define ZOPFLI_TOKEN_LLEXTRA(token) (((token) >> 9) & 31)
+/* Dist symbol + 1, 0 for literals. */
+#define ZOPFLI_TOKEN_DSYMBOL1(token) (((token) >> 14) & 31)
+#define ZOPFLI_TOKEN_DEXTRA(token) ((token) >> 19)
+
+/* Packs a literal (dist 0) or a length and dist pair into a token. */
+static inline unsigned ZopfliLZ77Token(unsigned litlen, unsigned dist) {
+  if (!dist) return litlen;
+  return ZopfliGetLengthSymbol(litlen) | (ZopfliGetLengthExtraBitsValue(litlen) << 9)
+      | ((ZopfliGetDistSymbol(dist) + 1) << 14) | (ZopfliGetDistExtraBitsValue(dist) << 19);
+}
+
+/* Gets the length of a match token, or 1 for a literal token. */
+static inline unsigned ZopfliTokenLength(unsigned token) {
+  static const unsigned short base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+  };
+  if (!ZOPFLI_TOKEN_DSYMBOL1(token)) return 1;
+  return base[ZOPFLI_TOKEN_LLSYMBOL(token) - 257] + ZOPFLI_TOKEN_LLEXTRA(token);
+}
+
+/* Gets the dist of a match token, or 0 for a literal token. */
+static inline unsigned ZopfliTokenDist(unsigned token) {
+  static const unsigned short base[31] = {
+    0, 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+    12289, 16385, 24577
+  };
+  return base[ZOPFLI_TOKEN_DSYMBOL1(token)] + ZOPFLI_TOKEN_DEXTRA(token);
+}
+
 void ZopfliInitLZ77Store(ZopfliLZ77Store* store);
 void ZopfliCleanLZ77Store(ZopfliLZ77Store* store);
 void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest);
 
+/*
+Makes room for count more tokens, growing the allocation geometrically so that
+appending stays cheap.
+*/
+void ZopfliLZ77StoreReserve(ZopfliLZ77Store* store, size_t count);
+
+/* Appends the tokens of source to dest. */
+void ZopfliAppendLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest);
+
 /*
 Verifies if length and dist are indeed valid, only used for assertion.
 */
@@ -63,19 +108,39 @@ void ZopfliVerifyLenDist(const unsigned char* data, size_t datasize, size_t pos,
 
 /*
 Counts the number of literal, length and distance symbols in the given lz77
-arrays.
-litlens: lz77 lit/lengths
-dists: ll77 distances
-start: where to begin counting in litlens and dists
-end: where to stop counting in litlens and dists (not inclusive)
+tokens.
+tokens: lz77 tokens, see ZopfliLZ77Store
+start: where to begin counting in tokens
+end: where to stop counting in tokens (not inclusive)
 ll_count: count of each lit/len symbol, must have size 288 (see deflate
     standard)
 d_count: count of each dist symbol, must have size 32 (see deflate standard)
 */
-void ZopfliLZ77Counts(const unsigned short* litlens,
-                      const unsigned short* dists,
-                      size_t start, size_t end,
-                      size_t* ll_count, size_t* d_count, unsigned char symbols);
+void ZopfliLZ77Counts(const unsigned* tokens, size_t start, size_t end,
+                      size_t* ll_count, size_t* d_count);
+
+/*
+Literal/length and distance symbol counts of a set of lz77 symbols, kept
+without the end symbol so that ranges can be added and removed again. Counts of
+overlapping or neighbouring ranges are then cheap deltas of each other.
+*/
+typedef struct ZopfliLZ77Histogram {
+  size_t ll_count[288];
+  size_t d_count[32];
+} ZopfliLZ77Histogram;
+
+void ZopfliLZ77HistogramClear(ZopfliLZ77Histogram* h);
+
+/* Adds the counts of the tokens from start to end (not inclusive). */
+void ZopfliLZ77HistogramAddRange(ZopfliLZ77Histogram* h, const unsigned* tokens,
+                                 size_t start, size_t end);
+
+/*
+Removes the counts of the tokens from start to end (not inclusive), which must
+have been added before.
+*/
+void ZopfliLZ77HistogramSubtractRange(ZopfliLZ77Histogram* h, const unsigned* tokens,
+                                      size_t start, size_t end);
 
 /*
 Does LZ77 using an algorithm similar to gzip, with lazy matching, rather than
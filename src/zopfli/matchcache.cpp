@@ -0,0 +1,204 @@
+//
+//  matchcache.cpp
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+
+#include "matchcache.h"
+
+#include <string.h>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#ifndef NOMULTI
+#include <mutex>
+#endif
+
+struct ZopfliMatchCacheEntry {
+  unsigned long long hash;
+  unsigned long long context;
+  size_t offset;
+  std::vector<unsigned char> data;
+  std::vector<unsigned char> lists;
+  std::vector<unsigned char> state;
+  std::list<ZopfliMatchCacheEntry*>::iterator lru;
+  unsigned users;
+  bool evicted;
+};
+
+//Most recently used first
+static std::list<ZopfliMatchCacheEntry*> entries;
+//Entries by hash of their data and context
+static std::unordered_multimap<unsigned long long, ZopfliMatchCacheEntry*> byhash;
+static size_t total = 0;
+static size_t limit = 0;
+#ifndef NOMULTI
+static std::mutex mtx;
+#endif
+
+unsigned long long ZopfliMatchCacheHash(const unsigned char* data, size_t size, unsigned long long seed) {
+  unsigned long long h = 14695981039346656037ULL ^ seed;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    unsigned long long word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  for (; i < size; i++) {
+    h = (h ^ data[i]) * 1099511628211ULL;
+  }
+  return h ^ size;
+}
+
+static size_t EntrySize(const ZopfliMatchCacheEntry* entry) {
+  return entry->data.size() + entry->lists.size() + entry->state.size();
+}
+
+static unsigned long long IndexKey(unsigned long long hash, unsigned long long context) {
+  return hash ^ (context * 0x9E3779B97F4A7C15ULL);
+}
+
+static bool SameKey(const ZopfliMatchCacheEntry* entry, unsigned long long hash, unsigned long long context, size_t size, size_t offset) {
+  return entry->hash == hash && entry->context == context && entry->offset == offset && entry->data.size() == size;
+}
+
+//Unlinks entry; it is deleted once its last user releases it
+static void Evict(ZopfliMatchCacheEntry* entry) {
+  auto range = byhash.equal_range(IndexKey(entry->hash, entry->context));
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == entry) {
+      byhash.erase(it);
+      break;
+    }
+  }
+  entries.erase(entry->lru);
+  total -= EntrySize(entry);
+  if (entry->users) {
+    entry->evicted = true;
+  }
+  else {
+    delete entry;
+  }
+}
+
+//Room for the lists and data of the whole input plus a few match finder states, the cap for large inputs
+static size_t LimitFor(size_t insize) {
+  size_t size = ((size_t)4 << 20) + 8 * insize;
+  return size < insize || size > ZOPFLI_MATCHCACHE_SIZE ? ZOPFLI_MATCHCACHE_SIZE : size;
+}
+
+void ZopfliMatchCacheReserve(size_t insize) {
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(mtx);
+#endif
+  size_t size = LimitFor(insize);
+  if (size > limit) {
+    limit = size;
+  }
+}
+
+ZopfliMatchCacheEntry* ZopfliMatchCacheFind(const unsigned char* in, size_t windowstart, size_t instart, size_t inend, unsigned long long context,
+                                            const unsigned char** lists, size_t* size, const unsigned char** state, size_t* statesize) {
+  const unsigned char* data = in + windowstart;
+  size_t datasize = inend - windowstart;
+  size_t offset = instart - windowstart;
+  unsigned long long hash = ZopfliMatchCacheHash(data, datasize, offset);
+  ZopfliMatchCacheEntry* found = 0;
+  {
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(mtx);
+#endif
+    auto range = byhash.equal_range(IndexKey(hash, context));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (SameKey(it->second, hash, context, datasize, offset)) {
+        found = it->second;
+        entries.splice(entries.begin(), entries, found->lru);
+        found->users++;
+        break;
+      }
+    }
+  }
+  if (!found) {
+    return 0;
+  }
+  //The data is compared in full, so the match lists are valid for it even if the hash collides. The entry can't be
+  //freed while it has users, so this runs without the lock.
+  if (memcmp(found->data.data(), data, datasize)) {
+    ZopfliMatchCacheRelease(found);
+    return 0;
+  }
+  *lists = found->lists.data();
+  *size = found->lists.size();
+  *state = found->state.data();
+  *statesize = found->state.size();
+  return found;
+}
+
+void ZopfliMatchCacheRelease(ZopfliMatchCacheEntry* entry) {
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(mtx);
+#endif
+  if (!--entry->users && entry->evicted) {
+    delete entry;
+  }
+}
+
+void ZopfliMatchCacheStore(const unsigned char* in, size_t windowstart, size_t instart, size_t inend, unsigned long long context,
+                           const unsigned char* lists, size_t size, const unsigned char* state, size_t statesize) {
+  const unsigned char* data = in + windowstart;
+  size_t datasize = inend - windowstart;
+  size_t offset = instart - windowstart;
+  size_t entrysize = datasize + size + statesize;
+  {
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(mtx);
+#endif
+    if (entrysize > limit / 4) {
+      return;
+    }
+  }
+  ZopfliMatchCacheEntry* entry = new ZopfliMatchCacheEntry;
+  entry->hash = ZopfliMatchCacheHash(data, datasize, offset);
+  entry->context = context;
+  entry->offset = offset;
+  entry->data.assign(data, data + datasize);
+  entry->lists.assign(lists, lists + size);
+  entry->state.assign(state, state + statesize);
+  entry->users = 0;
+  entry->evicted = false;
+
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(mtx);
+#endif
+  //Another thread may have compressed the same data at the same time. A different block with a colliding hash just
+  //isn't stored.
+  unsigned long long key = IndexKey(entry->hash, context);
+  auto range = byhash.equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (SameKey(it->second, entry->hash, context, datasize, offset)) {
+      delete entry;
+      return;
+    }
+  }
+  total += EntrySize(entry);
+  entries.push_front(entry);
+  entry->lru = entries.begin();
+  byhash.emplace(key, entry);
+  while (total > limit && !entries.empty()) {
+    Evict(entries.back());
+  }
+}
+
+void ZopfliMatchCacheClear(void) {
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(mtx);
+#endif
+  while (!entries.empty()) {
+    Evict(entries.back());
+  }
+  limit = 0;
+}
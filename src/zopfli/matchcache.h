@@ -0,0 +1,67 @@
+//
+//  matchcache.h
+//  Efficient Compression Tool
+//
+//  Created by Felix Hanau.
+//  Copyright (c) 2026 Felix Hanau.
+//
+//  Process-wide cache of the match lists found by the first squeeze iteration
+//  of a block. The lists only depend on the bytes of the block, the window
+//  before it and the match finder state handed over from the previous block,
+//  so a later block over the same bytes can replay them instead of running the
+//  match finder again. This happens when two PNG filter strategies produce the
+//  same scanlines, when a block boundary survives the next block splitting
+//  pass, and for duplicate files. Storing an entry costs a copy of the data and
+//  a match finder state of up to a few hundred KB, which only pays off when
+//  such repeats are expected, so it is enabled with ZopfliOptions.matchcache.
+
+#ifndef ZOPFLI_MATCHCACHE_H_
+#define ZOPFLI_MATCHCACHE_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Upper bound on the total size of the cached match lists, match finder states
+ and the data they belong to. Least recently used entries are evicted beyond
+ the limit set by ZopfliMatchCacheReserve, which is at most this. */
+#define ZOPFLI_MATCHCACHE_SIZE (256 << 20)
+
+typedef struct ZopfliMatchCacheEntry ZopfliMatchCacheEntry;
+
+/* Hash of size bytes of data, starting from seed. */
+unsigned long long ZopfliMatchCacheHash(const unsigned char* data, size_t size, unsigned long long seed);
+
+/*
+Looks up the match lists of the bytes from instart to inend, with the window
+starting at windowstart. context identifies everything else the lists depend
+on. Returns 0 if they aren't cached. Otherwise *lists and *size receive the
+cached lists and *state and *statesize the match finder state stored with them.
+Both stay valid until the entry is released.
+*/
+ZopfliMatchCacheEntry* ZopfliMatchCacheFind(const unsigned char* in, size_t windowstart, size_t instart, size_t inend, unsigned long long context,
+                                            const unsigned char** lists, size_t* size, const unsigned char** state, size_t* statesize);
+
+void ZopfliMatchCacheRelease(ZopfliMatchCacheEntry* entry);
+
+/* Stores a copy of the size bytes of encoded match lists found for the bytes
+from instart to inend and of the match finder state after them. */
+void ZopfliMatchCacheStore(const unsigned char* in, size_t windowstart, size_t instart, size_t inend, unsigned long long context,
+                           const unsigned char* lists, size_t size, const unsigned char* state, size_t statesize);
+
+/* Raises the size limit of the cache, if needed, to one proportional to an
+input of insize bytes. Called before compressing an input with the cache. */
+void ZopfliMatchCacheReserve(size_t insize);
+
+/* Drops all entries and resets the size limit. Entries still in use are freed
+once they are released. Long-running callers that don't want the cache to
+outlive a job call this when the job is done. */
+void ZopfliMatchCacheClear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* ZOPFLI_MATCHCACHE_H_ */
@@ -35,8 +35,13 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "util.h"
 #include "squeeze.h"
 #include "match.h"
+#include "matchcache.h"
 #include "../LzFind.h"
 #include "../threadLocal.h"
+#include "../timing.h"
+#ifndef NOMULTI
+#include "../threadpool.h"
+#endif
 
 #ifdef __SSE4_2__
 #include <nmmintrin.h>
@@ -119,19 +124,136 @@ length_array: output array of size (inend - instart) which will receive the best
     length to reach this byte from a previous byte.
 */
 
+/*
+Match lists found by the first iteration, replayed by the later ones. Every
+position starts with a varint: 0 for no matches, 1 if the list is the one of the
+previous entry one byte further (lengths decreased by one, dropping those that
+become too short), which is common inside long matches, or else the number of
+shorts in the list. Those are followed by each length as the difference to the
+previous one minus one, in a byte, and each distance as the zigzag coded
+difference to the previous one, in a varint.
+*/
 typedef struct _LZCache{
-  unsigned short* cache;
+  unsigned char* cache;
   size_t size;
   size_t pointer;
+  size_t length; /* Number of bytes written by the first iteration. */
+  unsigned short list[(ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 2]; /* Last list appended or read. */
+  unsigned listsize;
 } LZCache;
 
+/* Upper bound of the encoded size of a single list. */
+#define LZCACHE_MAX_ENTRY (2 + (ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 4)
+
 static void CreateCache(size_t len, LZCache* c){
-  c->size = len + 513;
-  c->cache = (unsigned short*)malloc(c->size * sizeof(unsigned short));
+  /* Most positions take one or two bytes. */
+  c->size = len * 2 + LZCACHE_MAX_ENTRY;
+  c->cache = (unsigned char*)malloc(c->size);
   if (!c->cache){
     exit(1);
   }
   c->pointer = 0;
+  c->listsize = 0;
+}
+
+static void RewindCache(LZCache* c){
+  c->pointer = 0;
+  c->listsize = 0;
+}
+
+static unsigned char* PutVarint(unsigned char* p, unsigned v){
+  while (v >= 128){
+    *p++ = (v & 127) | 128;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static const unsigned char* GetVarint(const unsigned char* p, unsigned* v){
+  unsigned result = *p & 127;
+  unsigned shift = 7;
+  while (*p++ & 128){
+    result |= (*p & 127) << shift;
+    shift += 7;
+  }
+  *v = result;
+  return p;
+}
+
+/* Appends numPairs shorts of matches, as returned by Bt3Zip_MatchFinder_GetMatches.
+Lengths are strictly increasing. */
+static void AppendCache(LZCache* c, const unsigned short* matches, unsigned numPairs){
+  if (c->size < c->pointer + LZCACHE_MAX_ENTRY){
+    c->size += c->size / 2 + LZCACHE_MAX_ENTRY;
+    c->cache = (unsigned char*)realloc(c->cache, c->size);
+    if (!c->cache){
+      exit(1);
+    }
+  }
+  unsigned char* p = c->cache + c->pointer;
+
+  unsigned same = numPairs != 0;
+  unsigned k = 0;
+  for (unsigned m = 0; m < c->listsize && same; m += 2){
+    if (c->list[m] <= ZOPFLI_MIN_MATCH){
+      continue;
+    }
+    same = k < numPairs && matches[k] == c->list[m] - 1 && matches[k + 1] == c->list[m + 1];
+    k += 2;
+  }
+  if (same && k == numPairs){
+    *p++ = 1;
+  }
+  else{
+    p = PutVarint(p, numPairs);
+    unsigned len = ZOPFLI_MIN_MATCH - 1;
+    unsigned dist = 0;
+    for (unsigned m = 0; m < numPairs; m += 2){
+      *p++ = matches[m] - len - 1;
+      int delta = (int)matches[m + 1] - (int)dist;
+      p = PutVarint(p, delta < 0 ? ~(unsigned)delta * 2 + 1 : (unsigned)delta * 2);
+      len = matches[m];
+      dist = matches[m + 1];
+    }
+  }
+  memcpy(c->list, matches, numPairs * sizeof(unsigned short));
+  c->listsize = numPairs;
+  c->pointer = p - c->cache;
+}
+
+/* Decodes the next list into c->list, returning its number of shorts. */
+static unsigned NextCache(LZCache* c){
+  const unsigned char* p = c->cache + c->pointer;
+  if (*p == 1){
+    unsigned k = 0;
+    for (unsigned m = 0; m < c->listsize; m += 2){
+      if (c->list[m] > ZOPFLI_MIN_MATCH){
+        c->list[k] = c->list[m] - 1;
+        c->list[k + 1] = c->list[m + 1];
+        k += 2;
+      }
+    }
+    c->listsize = k;
+    p++;
+  }
+  else{
+    unsigned numPairs;
+    p = GetVarint(p, &numPairs);
+    unsigned len = ZOPFLI_MIN_MATCH - 1;
+    unsigned dist = 0;
+    for (unsigned m = 0; m < numPairs; m += 2){
+      len += *p++ + 1;
+      unsigned delta;
+      p = GetVarint(p, &delta);
+      dist += delta & 1 ? ~(delta >> 1) : delta >> 1;
+      c->list[m] = len;
+      c->list[m + 1] = dist;
+    }
+    c->listsize = numPairs;
+  }
+  c->pointer = p - c->cache;
+  return c->listsize;
 }
 
 static void CleanCache(LZCache* c){
@@ -140,6 +262,69 @@ static void CleanCache(LZCache* c){
 
 thread_local CMatchFinder mf;
 thread_local int right;
+/* Identifies the data that went through the match finder state in mf and how,
+for the match cache. */
+thread_local unsigned long long mfchain;
+
+/* Header of the match finder state stored in the match cache, followed by the
+hash table and binary tree. */
+typedef struct MatchFinderState {
+  unsigned long long chain;
+  size_t buffer;
+  UInt32 pos;
+  UInt32 cyclicBufferPos;
+  UInt32 hashMask;
+  UInt32 hashBytes;
+} MatchFinderState;
+
+/* Chain value of the state exported by a block whose match finder started from
+the state with chain value chain, or from scratch if it is 0. */
+static unsigned long long MatchFinderChain(unsigned long long chain, const unsigned char* in, size_t windowstart, size_t instart, size_t inend, unsigned char storeincache, unsigned hashBytes) {
+  return ZopfliMatchCacheHash(in + windowstart, inend - windowstart, chain * 31 + (instart - windowstart) * 16 + hashBytes * 2 + !!storeincache);
+}
+
+/* Hash table size of a match finder for size bytes. */
+static unsigned MatchFinderHashLog(const ZopfliOptions* options, size_t size) {
+  if (options->hashlog) {
+    return options->hashlog;
+  }
+  unsigned hashlog = LZFIND_MIN_HASH_LOG;
+  while (hashlog < LZFIND_HASH_LOG && ((size_t)1 << hashlog) < size) {
+    hashlog++;
+  }
+  return hashlog;
+}
+
+/* Serializes mf if it was exported for the bytes of in up to inend. The cache
+key only covers the bytes from windowstart on, so the position is stored
+relative to windowstart: the same bytes may come back at another offset. */
+static size_t SaveMatchFinder(const unsigned char* in, size_t windowstart, size_t instart, size_t inend, unsigned char** state) {
+  if (!right || mf.buffer < in + instart || mf.buffer > in + inend) {
+    return 0;
+  }
+  MatchFinderState header = {mfchain, (size_t)(mf.buffer - (in + windowstart)), mf.pos, mf.cyclicBufferPos, mf.hashMask, mf.hashBytes};
+  *state = (unsigned char*)malloc(sizeof(header) + MatchFinder_TableSize(&mf));
+  if (!*state) exit(1); /* Allocation failed. */
+  memcpy(*state, &header, sizeof(header));
+  memcpy(*state + sizeof(header), mf.hash, MatchFinder_TableSize(&mf));
+  return sizeof(header) + MatchFinder_TableSize(&mf);
+}
+
+static void RestoreMatchFinder(const unsigned char* in, size_t windowstart, const unsigned char* state) {
+  MatchFinderState header;
+  memcpy(&header, state, sizeof(header));
+  mf.hashMask = header.hashMask;
+  mf.hashBytes = header.hashBytes;
+  mf.hash = (UInt32*)malloc(MatchFinder_TableSize(&mf));
+  if (!mf.hash) exit(1); /* Allocation failed. */
+  memcpy(mf.hash, state + sizeof(header), MatchFinder_TableSize(&mf));
+  mf.son = mf.hash + mf.hashMask + 1;
+  mf.buffer = in + windowstart + header.buffer;
+  mf.pos = header.pos;
+  mf.cyclicBufferPos = header.cyclicBufferPos;
+  mfchain = header.chain;
+  right = 1;
+}
 
 #include <stdint.h>
 typedef  uint8_t BYTE;
@@ -250,63 +435,163 @@ static int LZ4HC_InsertAndFindBestMatch3 (LZ3HC_Data_Structure* hc4,   /* Index
   return num;
 }
 
+/*
+Relaxes the costs of reaching j + curr ... j + len with a match of distance
+dist, where costs and length_array already point to j. Returns the next length
+to relax. The SIMD versions do the
+same float additions and strict comparisons as the scalar loop, so the result is
+identical.
+*/
+static unsigned RelaxLengths(const float* litlentable, float price2, unsigned dist, unsigned curr, unsigned len, float* costs, unsigned* length_array) {
+  for (; curr <= len; curr++) {
+    float x = price2 + litlentable[curr];
+    if (x < costs[curr]){
+      costs[curr] = x;
+      length_array[curr] = curr + dist;
+    }
+  }
+  return curr;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(_M_X64))
+#include <immintrin.h>
+
+static unsigned RelaxLengthsSSE2(const float* litlentable, float price2, unsigned dist, unsigned curr, unsigned len, float* costs, unsigned* length_array) {
+  __m128 price = _mm_set1_ps(price2);
+  __m128i lengths = _mm_add_epi32(_mm_set1_epi32(curr + dist), _mm_setr_epi32(0, 1, 2, 3));
+  for (; curr + 3 <= len; curr += 4) {
+    __m128 x = _mm_add_ps(price, _mm_loadu_ps(litlentable + curr));
+    __m128 old = _mm_loadu_ps(costs + curr);
+    __m128 lt = _mm_cmplt_ps(x, old);
+    if (_mm_movemask_ps(lt)) {
+      __m128i mask = _mm_castps_si128(lt);
+      __m128i oldlengths = _mm_loadu_si128((const __m128i*)(length_array + curr));
+      _mm_storeu_ps(costs + curr, _mm_or_ps(_mm_and_ps(lt, x), _mm_andnot_ps(lt, old)));
+      _mm_storeu_si128((__m128i*)(length_array + curr), _mm_or_si128(_mm_and_si128(mask, lengths), _mm_andnot_si128(mask, oldlengths)));
+    }
+    lengths = _mm_add_epi32(lengths, _mm_set1_epi32(4));
+  }
+  return RelaxLengths(litlentable, price2, dist, curr, len, costs, length_array);
+}
+
+__attribute__((target("avx2")))
+static unsigned RelaxLengthsAVX2(const float* litlentable, float price2, unsigned dist, unsigned curr, unsigned len, float* costs, unsigned* length_array) {
+  __m256 price = _mm256_set1_ps(price2);
+  __m256i lengths = _mm256_add_epi32(_mm256_set1_epi32(curr + dist), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  for (; curr + 7 <= len; curr += 8) {
+    __m256 x = _mm256_add_ps(price, _mm256_loadu_ps(litlentable + curr));
+    __m256 old = _mm256_loadu_ps(costs + curr);
+    __m256 lt = _mm256_cmp_ps(x, old, _CMP_LT_OQ);
+    if (_mm256_movemask_ps(lt)) {
+      __m256i oldlengths = _mm256_loadu_si256((const __m256i*)(length_array + curr));
+      _mm256_storeu_ps(costs + curr, _mm256_blendv_ps(old, x, lt));
+      _mm256_storeu_si256((__m256i*)(length_array + curr), _mm256_blendv_epi8(oldlengths, lengths, _mm256_castps_si256(lt)));
+    }
+    lengths = _mm256_add_epi32(lengths, _mm256_set1_epi32(8));
+  }
+  return RelaxLengths(litlentable, price2, dist, curr, len, costs, length_array);
+}
+
+static int RelaxUseAVX2(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+#define RELAX_LENGTHS(avx2, litlentable, price2, dist, curr, len, costs, length_array) \
+  ((avx2) ? RelaxLengthsAVX2 : RelaxLengthsSSE2)(litlentable, price2, dist, curr, len, costs, length_array)
+
+#elif defined(__aarch64__)
+
+static unsigned RelaxLengthsNEON(const float* litlentable, float price2, unsigned dist, unsigned curr, unsigned len, float* costs, unsigned* length_array) {
+  float32x4_t price = vdupq_n_f32(price2);
+  static const unsigned lanes[4] = {0, 1, 2, 3};
+  uint32x4_t lengths = vaddq_u32(vdupq_n_u32(curr + dist), vld1q_u32(lanes));
+  for (; curr + 3 <= len; curr += 4) {
+    float32x4_t x = vaddq_f32(price, vld1q_f32(litlentable + curr));
+    float32x4_t old = vld1q_f32(costs + curr);
+    uint32x4_t lt = vcltq_f32(x, old);
+    if (vmaxvq_u32(lt)) {
+      vst1q_f32(costs + curr, vbslq_f32(lt, x, old));
+      vst1q_u32(length_array + curr, vbslq_u32(lt, lengths, vld1q_u32(length_array + curr)));
+    }
+    lengths = vaddq_u32(lengths, vdupq_n_u32(4));
+  }
+  return RelaxLengths(litlentable, price2, dist, curr, len, costs, length_array);
+}
+
+static int RelaxUseAVX2(void) {
+  return 0;
+}
+
+#define RELAX_LENGTHS(avx2, litlentable, price2, dist, curr, len, costs, length_array) \
+  RelaxLengthsNEON(litlentable, price2, dist, curr, len, costs, length_array)
+
+#else
+
+static int RelaxUseAVX2(void) {
+  return 0;
+}
+
+#define RELAX_LENGTHS(avx2, litlentable, price2, dist, curr, len, costs, length_array) \
+  RelaxLengths(litlentable, price2, dist, curr, len, costs, length_array)
+
+#endif
+
+/* Prices of every length and dist under one cost model. */
+typedef struct CostTable {
+  int model; /* 0: not built yet, 1: fixed tree, 2: the stats in symbols. */
+  float symbols[59]; /* ll_symbols[257..285] followed by d_symbols[0..29]. */
+  float literals[256]; /* Only filled for the fixed tree. */
+  float litlentable[259];
+  float disttable[ZOPFLI_WINDOW_SIZE];
+} CostTable;
+
+/* Filling disttable touches the whole window, while consecutive forward passes
+often run with an unchanged model (replays, converged iterations), so every
+thread keeps its last table around. */
+static thread_local CostTable costtable;
+
+/* Gets the cost table for stats, or for the fixed tree if stats is NULL,
+rebuilding the thread's table only if the length or dist prices changed. */
+static const CostTable* GetCostTable(const SymbolStats* stats) {
+  CostTable* t = &costtable;
+  float symbols[59];
+  unsigned i;
+  if (stats) {
+    memcpy(symbols, &stats->ll_symbols[257], 29 * sizeof(float));
+    memcpy(symbols + 29, stats->d_symbols, 30 * sizeof(float));
+    if (t->model == 2 && !memcmp(t->symbols, symbols, sizeof(symbols))) return t;
+    memcpy(t->symbols, symbols, sizeof(symbols));
+    t->model = 2;
+  } else {
+    if (t->model == 1) return t;
+    t->model = 1;
+    for (i = 0; i < 144; i++) t->literals[i] = 8;
+    for (; i < 256; i++) t->literals[i] = 9;
+  }
+
+  for (i = 3; i < 259; i++) {
+    t->litlentable[i] = stats ? stats->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i)
+                              : 12 + (i > 114) + ZopfliGetLengthExtraBits(i);
+  }
+  for (unsigned s = 0; s < 30; s++) {
+    float cost = ZopfliGetDistSymbolExtraBits(s);
+    if (stats) cost = stats->d_symbols[s] + ZopfliGetDistSymbolExtraBits(s);
+    unsigned end = s < 29 ? ZopfliDistSymbolBase[s + 1] : ZOPFLI_WINDOW_SIZE;
+    for (i = ZopfliDistSymbolBase[s]; i < end; i++) t->disttable[i] = cost;
+  }
+  return t;
+}
+
+/* Replays the matches stored in c. first applies the same pruning as the first
+iteration of GetBestLengths, for matches taken from the match cache. */
 static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inend,
-                           SymbolStats* costcontext, unsigned* length_array, LZCache* c) {
+                           SymbolStats* costcontext, unsigned* length_array, LZCache* c, unsigned char first) {
   size_t i;
 
-  /*TODO: Put this in separate function*/
-  float litlentable [259];
-  float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
+  const CostTable* table = GetCostTable(costcontext);
+  const float* litlentable = table->litlentable;
+  const float* disttable = table->disttable;
   float* literals = costcontext->ll_symbols;
-  if (!disttable){
-    exit(1);
-  }
-    for (i = 3; i < 259; i++){
-      litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 1; i < 1025; i++){
-      disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
-    }
-    float counter = costcontext->d_symbols[20] + 9;
-    for (; i < 1537; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[21] + 9;
-    for (; i < 2049; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[22] + 10;
-    for (; i < 3073; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[23] + 10;
-    for (; i < 4097; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[24] + 11;
-    for (; i < 6145; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[25] + 11;
-    for (; i < 8193; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[26] + 12;
-    for (; i < 12289; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[27] + 12;
-    for (; i < 16385; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[28] + 13;
-    for (; i < 24577; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[29] + 13;
-    for (; i < 32768; i++){
-      disttable[i] = counter;
-    }
 
   size_t blocksize = inend - instart;
 
@@ -314,6 +599,7 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
   if (!costs) exit(1); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
+  int avx2 = RelaxUseAVX2();
   //Special handling for files with high redundancy
 #define RLE 1
 #define ML_MATCH 2
@@ -345,10 +631,8 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
       match_type = 0;
     }
 
-    unsigned short* matches = c->cache + c->pointer;
-    int numPairs = *matches;
-    matches++;
-    c->pointer += numPairs + 1;
+    int numPairs = NextCache(c);
+    const unsigned short* matches = c->list;
 
     if (numPairs){
       const unsigned short * mend = matches + numPairs;
@@ -370,7 +654,7 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
 #endif
       else{
         float price = costs[j];
-        unsigned short* mp = matches;
+        const unsigned short* mp = matches;
 
         unsigned curr = ZOPFLI_MIN_MATCH;
         while (mp < mend){
@@ -378,13 +662,15 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
           unsigned dist = *mp++;
           float price2 = price + disttable[dist];
           dist <<=9;
-          for (; curr <= len; curr++) {
-            float x = price2 + litlentable[curr];
-            if (x < costs[j + curr]){
-              costs[j + curr] = x;
-              length_array[j + curr] = curr + dist;
+          if (first) {
+            float old_costs = costs[j + len];
+            float new_costs = price2 + litlentable[len];
+            if (new_costs > old_costs + 6.0) {
+              curr = len + 1;
+              continue;
             }
           }
+          curr = RELAX_LENGTHS(avx2, litlentable, price2, dist, curr, len, costs + j, length_array + j);
         }
       }
     }
@@ -397,9 +683,8 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
     }
   }
 
-  c->pointer = 0;
+  RewindCache(c);
 
-  free(disttable);
   free(costs);
 }
 
@@ -407,105 +692,10 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
                            SymbolStats* costcontext, unsigned* length_array, unsigned char storeincache, LZCache* c, unsigned mfinexport) {
   size_t i;
 
-  /*TODO: Put this in separate function*/
-  float litlentable [259];
-  float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
-  float* literals;
-  if (!disttable){
-    exit(1);
-  }
-  if (costcontext){  /* Dynamic Block */
-
-    literals = costcontext->ll_symbols;
-    for (i = 3; i < 259; i++){
-      litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 1; i < 513; i++){
-      disttable[i] = costcontext->d_symbols[ZopfliGetDistSymbol(i)] + ZopfliGetDistExtraBits(i);
-    }
-    float counter = costcontext->d_symbols[18] + 8;
-    for (; i < 769; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[19] + 8;
-    for (; i < 1025; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[20] + 9;
-    for (; i < 1537; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[21] + 9;
-    for (; i < 2049; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[22] + 10;
-    for (; i < 3073; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[23] + 10;
-    for (; i < 4097; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[24] + 11;
-    for (; i < 6145; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[25] + 11;
-    for (; i < 8193; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[26] + 12;
-    for (; i < 12289; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[27] + 12;
-    for (; i < 16385; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[28] + 13;
-    for (; i < 24577; i++){
-      disttable[i] = counter;
-    }
-    counter = costcontext->d_symbols[29] + 13;
-    for (; i < 32768; i++){
-      disttable[i] = counter;
-    }
-  }
-  else {
-    literals = (float*)malloc(256 * sizeof(float));
-    if (!literals){
-      exit(1);
-    }
-
-    for (i = 0; i < 144; i++){
-      literals[i] = 8;
-    }
-    for (; i < 256; i++){
-      literals[i] = 9;
-    }
-    for (i = 3; i < 259; i++){
-      litlentable[i] = 12 + (i > 114) + ZopfliGetLengthExtraBits(i);
-    }
-    for (i = 1; i < 1025; i++){
-      disttable[i] = ZopfliGetDistExtraBits(i);
-    }
-    for (; i < 2049; i++){
-      disttable[i] = 9;
-    }
-    for (; i < 4097; i++){
-      disttable[i] = 10;
-    }
-    for (; i < 8193; i++){
-      disttable[i] = 11;
-    }
-    for (; i < 16385; i++){
-      disttable[i] = 12;
-    }
-    for (; i < 32768; i++){
-      disttable[i] = 13;
-    }
-  }
+  const CostTable* table = GetCostTable(costcontext);
+  const float* litlentable = table->litlentable;
+  const float* disttable = table->disttable;
+  const float* literals = costcontext ? costcontext->ll_symbols : table->literals;
 
   size_t blocksize = inend - instart;
 
@@ -513,12 +703,15 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
   if (!costs) exit(1); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
+  int avx2 = RelaxUseAVX2();
 
   size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
 
   CMatchFinder p;
   p.hash = 0;
+  unsigned long long chain = 0;
     if (mfinexport & right){
+      chain = mfchain;
       p = mf;
       p.bufend = &in[inend];
 
@@ -531,14 +724,11 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
       p.buffer = &in[windowstart];
       p.bufend = &in[inend];
 
-      MatchFinder_Create(&p);
+      MatchFinder_Create(&p, MatchFinderHashLog(options, inend - windowstart), options->hash4 ? 4 : 3);
       Bt3Zip_MatchFinder_Skip(&p, instart - windowstart);
     }
 
-  unsigned short* matches;
-  if (!storeincache){
-    matches = alloca(513 * sizeof(unsigned short));
-  }
+  unsigned short* matches = alloca(513 * sizeof(unsigned short));
 
   unsigned match_type = 0;
   unsigned dist_258 = inend + 1;
@@ -568,12 +758,13 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
             Bt3Zip_MatchFinder_Skip2(&p, now);
             CopyMF(&p, &mf);
             right = 1;
+            mfchain = MatchFinderChain(chain, in, windowstart, instart, inend, storeincache, p.hashBytes);
             Bt3Zip_MatchFinder_Skip2(&p, match - now);
           }
           else{
             if (match > 32768) {
               p.buffer = &in[i + match - 1];
-              memset(p.hash, 0, LZFIND_HASH_SIZE * sizeof(unsigned));
+              memset(p.hash, 0, (p.hashMask + 1) * sizeof(unsigned));
               p.cyclicBufferPos = 0;
               p.pos = ZOPFLI_WINDOW_SIZE;
               Bt3Zip_MatchFinder_Skip(&p, 1);
@@ -598,14 +789,8 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
       }
     }
     else {
-        if (c->size < c->pointer + (ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 2 + 1){
-          c->size *= 2;
-          c->cache = realloc(c->cache, c->size * sizeof(unsigned short));
-        }
-        matches = c->cache + c->pointer + 1;
         numPairs = Bt3Zip_MatchFinder_GetMatches(&p, matches);
-        *(matches - 1) = numPairs;
-        c->pointer += numPairs + 1;
+        AppendCache(c, matches, numPairs);
         match_type = 0;
     }
     if (numPairs){
@@ -628,7 +813,8 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
 #endif
       else{
         if (*(mend - 2) == ZOPFLI_MAX_MATCH && i + ZOPFLI_MAX_MATCH < inend && in[i + ZOPFLI_MAX_MATCH] == in[i + ZOPFLI_MAX_MATCH - *(mend - 1)]){match_type = ML_MATCH; dist_258 = *(mend - 1);}
-        else if (matches[1] == 1 && matches[0] > 3 && i + ZOPFLI_MAX_MATCH < inend) {match_type = RLE;}
+        /* The next position must have the same hash as this one. */
+        else if (matches[1] == 1 && matches[0] > p.hashBytes && i + ZOPFLI_MAX_MATCH < inend) {match_type = RLE;}
         float price = costs[j];
         unsigned short* mp = matches;
 
@@ -649,13 +835,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
             curr = len + 1;
             continue;
           }
-          for (; curr <= len; curr++) {
-            float x = price2 + litlentable[curr];
-            if (x < costs[j + curr]){
-              costs[j + curr] = x;
-              length_array[j + curr] = curr + dist;
-            }
-          }
+          curr = RELAX_LENGTHS(avx2, litlentable, price2, dist, curr, len, costs + j, length_array + j);
         }
       }
     }
@@ -670,18 +850,22 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
     if (i == inend - ZOPFLI_MAX_MATCH - 1 && mfinexport & 2){
       CopyMF(&p, &mf);
       right = 1;
+      mfchain = MatchFinderChain(chain, in, windowstart, instart, inend, storeincache, p.hashBytes);
     }
   }
 
   MatchFinder_Free(&p);
   if (storeincache){
-    c->pointer = 0;
+    /* The lists are kept for all further iterations. */
+    c->length = c->pointer;
+    c->size = c->length + 1;
+    c->cache = (unsigned char*)realloc(c->cache, c->size);
+    if (!c->cache){
+      exit(1);
+    }
+    RewindCache(c);
   }
 
-  if (!costcontext){
-    free(literals);
-  }
-  free(disttable);
   free(costs);
 }
 
@@ -807,11 +991,7 @@ static void TraceBackwards(size_t size, const unsigned* length_array,
 }
 
 static void FollowPath(unsigned* path, size_t pathsize, ZopfliLZ77Store* store) {
-  store->litlens = (unsigned short*)malloc(pathsize * sizeof(unsigned short));
-  store->dists = (unsigned short*)malloc(pathsize * sizeof(unsigned short));
-  if (!store->litlens || !store->dists){
-    exit(1);
-  }
+  ZopfliLZ77StoreReserve(store, pathsize);
 
   /*pathsize contains matches in reverted order.*/
   for (size_t i = pathsize - 1;; i--) {
@@ -819,15 +999,9 @@ static void FollowPath(unsigned* path, size_t pathsize, ZopfliLZ77Store* store)
 
     /* Add to output. */
     if (length >= ZOPFLI_MIN_MATCH) {
-
-      unsigned short dist = path[i] >> 9;
-
-      store->litlens[store->size] = length;
-      store->dists[store->size] = dist;
-
+      store->tokens[store->size] = ZopfliLZ77Token(length, path[i] >> 9);
     } else {
-      store->litlens[store->size] = path[i] >> 24;
-      store->dists[store->size] = 0;
+      store->tokens[store->size] = path[i] >> 24;
     }
 
     store->size++;
@@ -873,7 +1047,7 @@ static void CalculateStatistics(SymbolStats* stats) {
 
 /* Appends the symbol statistics from the store. */
 void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats) {
-  ZopfliLZ77Counts(store->litlens, store->dists, 0, store->size, stats->litlens, stats->dists, store->symbols);
+  ZopfliLZ77Counts(store->tokens, 0, store->size, stats->litlens, stats->dists);
 
   CalculateStatistics(stats);
 }
@@ -899,8 +1073,8 @@ static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in
     GetBestLengthsultra2(in, instart, inend, costcontext, length_array);
   }
   else{
-    if(storeincache == 2){
-      GetBestLengths2(in, instart, inend, costcontext, length_array, c);
+    if(storeincache >= 2){
+      GetBestLengths2(in, instart, inend, costcontext, length_array, c, storeincache == 3);
     }
     else{
         GetBestLengths(options, in, instart, inend, costcontext, length_array, storeincache, c, mfinexport);
@@ -917,6 +1091,93 @@ static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in
 /*TODO: Replace this w/ proper implementation. This performs bad on files w/ changing redundancy */
 static thread_local SymbolStats st;
 
+/* Everything besides the data that the match lists of a block depend on. */
+static unsigned long long MatchCacheContext(const ZopfliOptions* options, unsigned mfinexport) {
+  return (((mfinexport & right) ? mfchain : 0) * 2 + !!(mfinexport & 2)) * 2 + !!options->hash4;
+}
+
+/* Number of cost models tried at once after the iterations stall, with --mt-deflate. */
+#define SQUEEZE_CANDIDATES 4
+
+typedef struct SqueezeCandidates {
+  const ZopfliOptions* options;
+  const unsigned char* in;
+  size_t instart;
+  size_t inend;
+  const LZCache* c;
+  SymbolStats* stats;
+  ZopfliLZ77Store* stores;
+  double* costs;
+} SqueezeCandidates;
+
+static void SqueezeCandidate(void* context, size_t i) {
+  SqueezeCandidates* s = (SqueezeCandidates*)context;
+  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (s->inend - s->instart + 1));
+  if (!length_array) exit(1); /* Allocation failed. */
+  /* Every candidate reads the match lists with its own position. */
+  LZCache c = *s->c;
+  RewindCache(&c);
+  ZopfliInitLZ77Store(&s->stores[i]);
+  LZ77OptimalRun(s->options, s->in, s->instart, s->inend, length_array, &s->stats[i], &s->stores[i], 2, &c, 0, 0);
+  s->costs[i] = ZopfliCalculateBlockSize(s->stores[i].tokens, 0, s->stores[i].size, 2, s->options->searchext);
+  free(length_array);
+}
+
+/*
+Prepares the cost models tried besides the next regular iteration once the
+iterations stall: further random perturbations of the best statistics and a
+blend of the best and last ones. Returns their number.
+*/
+static unsigned PrepareCandidates(RanState* ran_state, const SymbolStats* beststats, const SymbolStats* laststats, SymbolStats* candidates) {
+  unsigned n = 0;
+  for (; n < SQUEEZE_CANDIDATES - 2; n++) {
+    CopyStats(beststats, &candidates[n]);
+    RandomizeStatFreqs(ran_state, &candidates[n]);
+    CalculateStatistics(&candidates[n]);
+  }
+  AddWeightedStatFreqs(beststats, 1.0, laststats, .5, &candidates[n]);
+  CalculateStatistics(&candidates[n]);
+  return n + 1;
+}
+
+/*
+Runs an iteration with stats, into store, and with each of the n candidates
+concurrently, matches taken from c. Returns the cost of the result for stats.
+If a candidate does better than *sidecost, its result goes to sidestore, its
+cost to *sidecost and its statistics to sidestats.
+*/
+static double RunCandidates(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, const LZCache* c,
+                            const SymbolStats* stats, const SymbolStats* candidates, unsigned n, ZopfliLZ77Store* store,
+                            ZopfliLZ77Store* sidestore, double* sidecost, SymbolStats* sidestats) {
+  SymbolStats all[SQUEEZE_CANDIDATES];
+  ZopfliLZ77Store stores[SQUEEZE_CANDIDATES];
+  double costs[SQUEEZE_CANDIDATES];
+  CopyStats(stats, &all[0]);
+  for (unsigned k = 0; k < n; k++) {
+    CopyStats(&candidates[k], &all[k + 1]);
+  }
+  SqueezeCandidates s = {options, in, instart, inend, c, all, stores, costs};
+#ifndef NOMULTI
+  ThreadPoolParallelFor(n + 1, SqueezeCandidate, &s);
+#else
+  for (unsigned k = 0; k <= n; k++) {
+    SqueezeCandidate(&s, k);
+  }
+#endif
+
+  ZopfliCleanLZ77Store(store);
+  *store = stores[0];
+  for (unsigned k = 1; k <= n; k++) {
+    if (costs[k] < *sidecost) {
+      ZopfliCopyLZ77Store(&stores[k], sidestore);
+      *sidecost = costs[k];
+      CopyStats(&candidates[k - 1], sidestats);
+    }
+    ZopfliCleanLZ77Store(&stores[k]);
+  }
+  return costs[0];
+}
+
 static void ZopfliLZ77Optimal(const ZopfliOptions* options,
                        const unsigned char* in, size_t instart, size_t inend,
                        ZopfliLZ77Store* store, unsigned char first, SymbolStats* statsp, unsigned mfinexport) {
@@ -930,11 +1191,31 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
   /* Try randomizing the costs a bit once the size stabilizes. */
   RanState ran_state;
   int lastrandomstep = -1;
+  /* With --speculate, more cost models are tried alongside each randomized
+  iteration. They draw from their own random state and don't feed back into the
+  iterations, whose results stay the same; their best result is only used if
+  its estimated cost beats them. This is possible as the later iterations only
+  replay the cached matches. */
+  int speculate = options->speculate && options->multithreading > 1 && options->useCache;
+  RanState side_ran_state;
+  SymbolStats candidates[SQUEEZE_CANDIDATES - 1];
+  unsigned ncandidates = 0;
+  ZopfliLZ77Store sidestore;
+  double sidecost = ZOPFLI_LARGE_FLOAT;
+  SymbolStats sidestats;
+  /* Best cost after each of the last ZOPFLI_CONVERGENCE_WINDOW iterations. */
+  double window[ZOPFLI_CONVERGENCE_WINDOW];
+  double loopstart = TimingStart();
+  /* Lowered once the block has converged. */
+  int numiterations = options->numiterations;
 
   if (!length_array) exit(1); /* Allocation failed. */
 
   InitRanState(&ran_state);
+  InitRanState(&side_ran_state);
+  side_ran_state.m_w = 3;
   ZopfliInitLZ77Store(&currentstore);
+  ZopfliInitLZ77Store(&sidestore);
 
   /* Do regular deflate, then loop multiple shortest path runs, each time using
   the statistics of the previous run. */
@@ -999,17 +1280,40 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
 
   LZCache c;
   int stinit = 0;
-  if (options->useCache){
+  /* Besides the data, the matches depend on the match finder state imported
+  from the previous block. If they come from the match cache, so does the state
+  exported to the next block. */
+  size_t windowstart = instart > ZOPFLI_WINDOW_SIZE ? instart - ZOPFLI_WINDOW_SIZE : 0;
+  unsigned long long context = MatchCacheContext(options, mfinexport);
+  ZopfliMatchCacheEntry* cached = 0;
+  if (options->useCache && options->matchcache){
+    const unsigned char* lists;
+    const unsigned char* state;
+    size_t statesize;
+    if ((cached = ZopfliMatchCacheFind(in, windowstart, instart, inend, context, &lists, &c.length, &state, &statesize))){
+      c.cache = (unsigned char*)lists;
+      c.size = c.length;
+      RewindCache(&c);
+      if (mfinexport & right){
+        MatchFinder_Free(&mf);
+        right = 0;
+      }
+      if (statesize){
+        RestoreMatchFinder(in, windowstart, state);
+      }
+    }
+  }
+  if (options->useCache && !cached){
     CreateCache(inend - instart, &c);
   }
   /* Repeat statistics with each time the cost model from the previous stat
   run. */
-  for (int i = 1; i < options->numiterations + 1; i++) {
+  for (int i = 1; i < numiterations + 1; i++) {
     ZopfliCleanLZ77Store(&currentstore);
     ZopfliInitLZ77Store(&currentstore);
 
     //TODO: This is very powerful and needs additional tuning.
-    if ((i == options->numiterations - 1 && options->numiterations > 5)|| (i == 9/* && !options->ultra*/) || i == 30){//TODO:Disabling this helps with high iters, also with enwik -6
+    if ((i == numiterations - 1 && options->numiterations > 5)|| (i == 9/* && !options->ultra*/) || i == 30){//TODO:Disabling this helps with high iters, also with enwik -6
       unsigned bl[288];
 
       OptimizeHuffmanCountsForRle(32, beststats.dists);
@@ -1026,10 +1330,24 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       }
     }
 
-    LZ77OptimalRun(options, in, instart, inend, length_array, &stats, &currentstore, options->useCache ? i == 1 ? 1 : 2 : 0, &c, mfinexport, 0);
+    double timing = TimingStart();
+    if (ncandidates){
+      cost = RunCandidates(options, in, instart, inend, &c, &stats, candidates, ncandidates, &currentstore, &sidestore, &sidecost, &sidestats);
+      ncandidates = 0;
+    }
+    else{
+      LZ77OptimalRun(options, in, instart, inend, length_array, &stats, &currentstore, options->useCache ? i == 1 ? cached ? 3 : 1 : 2 : 0, &c, mfinexport, 0);
+      if (i == 1 && options->useCache && options->matchcache && !cached){
+        unsigned char* state = 0;
+        size_t statesize = mfinexport & 2 ? SaveMatchFinder(in, windowstart, instart, inend, &state) : 0;
+        ZopfliMatchCacheStore(in, windowstart, instart, inend, context, c.cache, c.length, state, statesize);
+        free(state);
+      }
+      cost = ZopfliCalculateBlockSize(currentstore.tokens, 0, currentstore.size, 2, options->searchext);
+    }
 
     unsigned gui = 0;
-    cost = ZopfliCalculateBlockSize(currentstore.litlens, currentstore.dists, 0, currentstore.size, 2, options->searchext, currentstore.symbols);
+    TimingStage("squeeze", timing, inend - instart, (size_t)(cost / 8));
     if (cost < bestcost) {
       /* Copy to the output store. */
       ZopfliCopyLZ77Store(&currentstore, store);
@@ -1058,12 +1376,34 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       RandomizeStatFreqs(&ran_state, &stats);
       CalculateStatistics(&stats);
       lastrandomstep = i;
+      if (speculate && i < numiterations){
+        ncandidates = PrepareCandidates(&side_ran_state, &beststats, &laststats, candidates);
+      }
     }
     lastcost = cost;
     if(gui && options->numiterations < 6){break;}
+    if(TimingDeadlineExpired()){break;}
+    /* The random steps move the cost model a lot even after it has settled, so
+    only the cost tells whether further iterations are worthwhile. The last two
+    iterations still run, as the one before the last rebuilds the model from
+    the best code lengths. */
+    if (options->convergence > 0 && i > ZOPFLI_CONVERGENCE_WINDOW && i + 2 < numiterations
+        && window[i % ZOPFLI_CONVERGENCE_WINDOW] - bestcost < options->convergence * bestcost){
+      TimingStage("converged", loopstart, inend - instart, (size_t)(bestcost / 8));
+      numiterations = i + 2;
+    }
+    window[i % ZOPFLI_CONVERGENCE_WINDOW] = bestcost;
   }
+  if (sidecost < bestcost){
+    /* beststats keeps describing the best store, for the cost model handed to
+    the next block. */
+    ZopfliCopyLZ77Store(&sidestore, store);
+    CopyStats(&sidestats, &beststats);
+    bestcost = sidecost;
+  }
+  ZopfliCleanLZ77Store(&sidestore);
 
-  if (options->ultra){
+  if (options->ultra && !TimingDeadlineExpired()){
     unsigned bl[288];
     unsigned bld[32];
 
@@ -1086,7 +1426,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
       ZopfliLZ77Store peace;
       ZopfliInitLZ77Store(&peace);
       LZ77OptimalRun(options, in, instart, inend, length_array, &sta, &peace, options->useCache ? 2 : 0, &c, mfinexport, 0);
-      double newcost = ZopfliCalculateBlockSize(peace.litlens, peace.dists, 0, peace.size, 2, options->searchext, peace.symbols);
+      double newcost = ZopfliCalculateBlockSize(peace.tokens, 0, peace.size, 2, options->searchext);
       if (newcost < bestcost){
         double improv = bestcost - newcost;
         bestcost = newcost;
@@ -1122,7 +1462,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
               ista.d_symbols[j] = bld[j];
             }
             LZ77OptimalRun(options, in, instart, inend, length_array, &ista, &peace, 0, &c, mfinexport, 1);
-            newcost = ZopfliCalculateBlockSize(peace.litlens, peace.dists, 0, peace.size, 2, options->searchext, peace.symbols);
+            newcost = ZopfliCalculateBlockSize(peace.tokens, 0, peace.size, 2, options->searchext);
             if (newcost < bestcost){
               bestcost = newcost;
               ZopfliCopyLZ77Store(&peace, store);
@@ -1145,7 +1485,10 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
     }
   }
 
-  if (options->useCache){
+  if (cached){
+    ZopfliMatchCacheRelease(cached);
+  }
+  else if (options->useCache){
     CleanCache(&c);
   }
   free(length_array);
@@ -1230,7 +1573,9 @@ void ZopfliLZ77Optimal2(const ZopfliOptions* options,
   /* Dist to get to here with smallest cost. */
   unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
   if (!length_array) exit(1); /* Allocation failed. */
+  double timing = TimingStart();
   LZ77OptimalRun(options, in, instart, inend, length_array, options->reuse_costmodel ? &st : &stats, store, 0, 0, mfinexport, 0);
+  TimingStage("squeeze", timing, inend - instart, 0);
   free(length_array);
 
   if (!options->multithreading){
@@ -0,0 +1,96 @@
+/*
+Checks that ZopfliLengthLimitedCodeLengths, which tries the in-place Huffman
+construction before falling back to package-merge, returns the same bit lengths
+as plain boundary package-merge, and times both on the same histograms.
+
+Usage: katajainen_test [histograms]
+*/
+
+#include "../katajainen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+/* Histogram shapes: random, flat, power-of-two (binds the limit), Zipf-like. */
+static std::vector<size_t> MakeHistogram(std::mt19937& rng, unsigned t) {
+  static const int sizes[3] = {32, 288, 19};
+  int n = sizes[t % 3];
+  std::vector<size_t> f(n);
+  for (int i = 0; i < n; i++) {
+    size_t v;
+    switch (t % 9) {
+      case 0: v = rng() % 4; break;
+      case 1: v = rng() % 100; break;
+      case 2: v = (size_t)1 << (rng() % 20); break;
+      case 3: v = (size_t)(100000.0 / ((i + 1) * (i + 1))); break;
+      case 4: v = (rng() & 1) ? 7 : 0; break;
+      case 5: v = rng() % ((size_t)1 << 30); break;
+      case 6: v = i < 20 ? (size_t)1 << i : rng() % 3; break;
+      default: v = (size_t)(1000.0 / (1 + i * (rng() % 4))); break;
+    }
+    f[i] = rng() % 4 ? v : 0;
+  }
+  return f;
+}
+
+int main(int argc, char** argv) {
+  unsigned count = argc > 1 ? atoi(argv[1]) : 60000;
+  std::mt19937 rng(3);
+  std::vector<std::vector<size_t> > histograms;
+  for (unsigned t = 0; t < count; t++) {
+    histograms.push_back(MakeHistogram(rng, t));
+  }
+
+  static const int limits[5] = {15, 14, 12, 9, 7};
+  unsigned long calls = 0, binding = 0, mismatches = 0;
+  for (size_t h = 0; h < histograms.size(); h++) {
+    const std::vector<size_t>& f = histograms[h];
+    int n = f.size();
+    int used = 0;
+    for (int i = 0; i < n; i++) {
+      used += f[i] != 0;
+    }
+    unsigned unlimited[288];
+    ZopfliPackageMergeCodeLengths(f.data(), n, 15, unlimited);
+    for (int l = 0; l < 5; l++) {
+      int maxbits = limits[l];
+      if ((1 << maxbits) < used) {
+        continue;
+      }
+      unsigned a[288], b[288];
+      ZopfliPackageMergeCodeLengths(f.data(), n, maxbits, a);
+      ZopfliLengthLimitedCodeLengths(f.data(), n, maxbits, b);
+      calls++;
+      binding += memcmp(a, unlimited, n * sizeof(unsigned)) != 0;
+      if (memcmp(a, b, n * sizeof(unsigned))) {
+        if (!mismatches) {
+          fprintf(stderr, "Mismatch: histogram %zu, maxbits %d\n", h, maxbits);
+        }
+        mismatches++;
+      }
+    }
+  }
+  printf("%lu calls, %lu with a binding limit, %lu mismatches\n", calls, binding, mismatches);
+
+  for (int fast = 0; fast < 2; fast++) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    unsigned sink = 0;
+    for (size_t h = 0; h < histograms.size(); h++) {
+      unsigned lengths[288];
+      if (fast) {
+        ZopfliLengthLimitedCodeLengths(histograms[h].data(), histograms[h].size(), 15, lengths);
+      }
+      else {
+        ZopfliPackageMergeCodeLengths(histograms[h].data(), histograms[h].size(), 15, lengths);
+      }
+      sink += lengths[0];
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%s: %.3fs (%u)\n", fast ? "in-place" : "package-merge", elapsed, sink);
+  }
+  return mismatches != 0;
+}
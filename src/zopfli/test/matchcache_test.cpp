@@ -0,0 +1,95 @@
+/*
+Round-trips an input whose master blocks repeat the bytes of earlier ones at
+another offset, so the match cache hands out lists and match finder states that
+were stored for a different position in the input. The block after such a hit
+continues the match finder state and must search the bytes it compresses, not
+the earlier copy.
+
+Part 1 is zeros ending in a random 32K block W, part 2 is text ending in the
+same W, and part 3 is part 2 with W replaced by a random block with another
+period, so matches found in the earlier copy are invalid there.
+*/
+
+#include "../../main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <random>
+#include <vector>
+
+#define PART_SIZE 5000000
+#define WINDOW 32768
+
+/* WINDOW random bytes repeating every period bytes. */
+static std::vector<unsigned char> RandomWindow(std::mt19937& rng, size_t period) {
+  std::vector<unsigned char> window(WINDOW);
+  for (size_t i = 0; i < window.size(); i++) {
+    window[i] = i < period ? rng() : window[i - period];
+  }
+  return window;
+}
+
+static std::vector<unsigned char> MakeInput() {
+  std::mt19937 rng(15);
+  std::vector<unsigned char> window = RandomWindow(rng, 16384);
+
+  static const char* words[] = {"match ", "finder ", "block ", "window ", "deflate ", "cache ", "lists ", "state ",
+                                "offset ", "squeeze ", "the ", "of ", "and ", "a ", "to ", "in ", "\n"};
+  std::vector<unsigned char> text;
+  while (text.size() < PART_SIZE - WINDOW) {
+    const char* word = words[rng() % (sizeof(words) / sizeof(words[0]))];
+    text.insert(text.end(), word, word + strlen(word));
+  }
+  text.resize(PART_SIZE - WINDOW);
+
+  std::vector<unsigned char> in(PART_SIZE - WINDOW, 0);
+  in.insert(in.end(), window.begin(), window.end());
+  in.insert(in.end(), text.begin(), text.end());
+  in.insert(in.end(), window.begin(), window.end());
+  window = RandomWindow(rng, 12000);
+  in.insert(in.end(), text.begin(), text.end());
+  in.insert(in.end(), window.begin(), window.end());
+  return in;
+}
+
+int main() {
+  std::vector<unsigned char> in = MakeInput();
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  ZopfliTuning tuning;
+  ZopfliInitTuning(&tuning);
+  tuning.matchcache = 1;
+  ZopfliBuffer(4, 0, &tuning, in.data(), in.size(), &out, &outsize);
+
+  std::vector<unsigned char> check(in.size() + 1);
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, -15) != Z_OK) {
+    return 1;
+  }
+  stream.next_in = out;
+  stream.avail_in = outsize;
+  stream.next_out = check.data();
+  stream.avail_out = check.size();
+  int status = inflate(&stream, Z_FINISH);
+  size_t checksize = stream.total_out;
+  inflateEnd(&stream);
+  free(out);
+
+  if (status != Z_STREAM_END) {
+    fprintf(stderr, "Inflate failed: %d\n", status);
+    return 1;
+  }
+  if (checksize != in.size() || memcmp(check.data(), in.data(), in.size())) {
+    size_t i = 0;
+    while (i < checksize && i < in.size() && check[i] == in[i]) {
+      i++;
+    }
+    fprintf(stderr, "Output differs from the input at byte %zu\n", i);
+    return 1;
+  }
+  printf("%zu -> %zu bytes, round trip OK\n", in.size(), outsize);
+  return 0;
+}
@@ -60,32 +60,73 @@ Set this to, for example, 20MB (20000000). Set it to 0 to disable master blocks.
 */
 #define ZOPFLI_MASTER_BLOCK_SIZE 5000000
 
+/*
+Number of squeeze iterations over which the improvement of a block is measured
+to decide whether it has converged, see ZopfliOptions.convergence.
+*/
+#define ZOPFLI_CONVERGENCE_WINDOW 16
+
 /*
 Used to initialize costs for example
 */
 #define ZOPFLI_LARGE_FLOAT 1e30
 
+/*
+Lookup tables for the deflate length and dist codes, cfr. the DEFLATE spec. The
+length tables are indexed by length, the dist and per-symbol tables by symbol,
+except ZopfliDistSymbolTable which is indexed as in ZopfliGetDistSymbol.
+*/
+extern const unsigned short ZopfliLengthSymbolTable[259];
+extern const unsigned char ZopfliLengthExtraBitsTable[259];
+extern const unsigned char ZopfliLengthExtraBitsValueTable[259];
+extern const unsigned char ZopfliLengthSymbolExtraBitsTable[29];
+extern const unsigned char ZopfliDistSymbolTable[512];
+extern const unsigned short ZopfliDistSymbolBase[30];
+extern const unsigned char ZopfliDistSymbolExtraBitsTable[30];
+
 /*
 Gets the symbol for the given length, cfr. the DEFLATE spec.
 Returns the symbol in the range [257-285] (inclusive)
 */
-unsigned ZopfliGetLengthSymbol(unsigned l);
+static inline unsigned ZopfliGetLengthSymbol(unsigned l) {
+  return ZopfliLengthSymbolTable[l];
+}
 
 /* Gets the amount of extra bits for the given length, cfr. the DEFLATE spec. */
-unsigned ZopfliGetLengthExtraBits(unsigned l);
+static inline unsigned ZopfliGetLengthExtraBits(unsigned l) {
+  return ZopfliLengthExtraBitsTable[l];
+}
 
 /* Gets value of the extra bits for the given length, cfr. the DEFLATE spec. */
-unsigned ZopfliGetLengthExtraBitsValue(unsigned l);
+static inline unsigned ZopfliGetLengthExtraBitsValue(unsigned l) {
+  return ZopfliLengthExtraBitsValueTable[l];
+}
+
+/* Gets the amount of extra bits for the given length symbol. */
+static inline unsigned ZopfliGetLengthSymbolExtraBits(unsigned s) {
+  return ZopfliLengthSymbolExtraBitsTable[s - 257];
+}
 
 /* Gets the symbol for the given dist, cfr. the DEFLATE spec. */
-int ZopfliGetDistSymbol(int dist);
+static inline int ZopfliGetDistSymbol(int dist) {
+  return ZopfliDistSymbolTable[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+}
 int ZopfliNextDistSymbol(int dist);
 
+/* Gets the amount of extra bits for the given dist symbol. */
+static inline unsigned ZopfliGetDistSymbolExtraBits(unsigned s) {
+  return ZopfliDistSymbolExtraBitsTable[s];
+}
+
 /* Gets the amount of extra bits for the given dist, cfr. the DEFLATE spec. */
-unsigned ZopfliGetDistExtraBits(unsigned dist);
+static inline unsigned ZopfliGetDistExtraBits(unsigned dist) {
+  return ZopfliDistSymbolExtraBitsTable[ZopfliGetDistSymbol(dist)];
+}
 
 /* Gets value of the extra bits for the given dist, cfr. the DEFLATE spec. */
-unsigned ZopfliGetDistExtraBitsValue(unsigned dist);
+static inline unsigned ZopfliGetDistExtraBitsValue(unsigned dist) {
+  return dist - ZopfliDistSymbolBase[ZopfliGetDistSymbol(dist)];
+}
 
 #ifdef __GNUC__
 #define likely(x)      __builtin_expect(!!(x), 1)
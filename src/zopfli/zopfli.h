@@ -29,6 +29,12 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 extern "C" {
 #endif
 
+/*
+Candidate split points for ZopfliOptions.optimalsplit when the dynamic-programming
+splitter is requested.
+*/
+#define ZOPFLI_OPTIMAL_SPLIT_CANDIDATES 32
+
 /*
 Options used throughout the program.
 */
@@ -66,6 +72,7 @@ typedef struct ZopfliOptions {
    */
   unsigned searchext;
 
+  /*Start squeezing a block from the cost model of the block before it. Only set without multithreading.*/
   unsigned reuse_costmodel;
 
   /*When using more than one iteration, this will save the found matches on the first run so they don't need to be found again. Uses large amounts of memory.*/
@@ -94,8 +101,50 @@ typedef struct ZopfliOptions {
 
   /*Use advanced huffman and header optimizations.*/
   unsigned advanced;
+
+  /*Start block splitting with the cheapest partition over this many evenly spaced candidate split points. 0 to split recursively
+  only. Off by default, ZOPFLI_OPTIMAL_SPLIT_CANDIDATES is a good value.*/
+  unsigned optimalsplit;
+
+  /*Log2 of the match finder hash table size, 0 to choose it from the input size. Only affects speed.*/
+  unsigned hashlog;
+
+  /*Hash 4 instead of 3 bytes in the match finder. Faster, but most length 3 matches are missed.*/
+  unsigned hash4;
+
+  /*Stop squeezing a block once its best cost improved by less than this fraction over the last ZOPFLI_CONVERGENCE_WINDOW
+  iterations. 0 to always run numiterations.*/
+  double convergence;
+
+  /*Share the match lists of the first iteration of each block with later blocks over the same bytes through the
+  process-wide match cache, see matchcache.h. Costs memory and only helps when the same data is compressed again, so it
+  is off by default.*/
+  unsigned matchcache;
+
+  /*With multithreading, squeeze extra cost models alongside the randomized iterations and keep the best result. The
+  candidates are picked by estimated cost, which doesn't always give a smaller output, so it is off by default.*/
+  unsigned speculate;
 } ZopfliOptions;
 
+/*
+Settings the entry points pass down to ZopfliOptions besides the compression
+level and the thread count. New settings go here, so that the entry points
+don't need another parameter for each of them.
+*/
+typedef struct ZopfliTuning {
+  /* See ZopfliOptions.convergence. */
+  double convergence;
+
+  /* See ZopfliOptions.optimalsplit. */
+  unsigned optimalsplit;
+
+  /* See ZopfliOptions.matchcache. */
+  unsigned matchcache;
+
+  /* See ZopfliOptions.speculate. */
+  unsigned speculate;
+} ZopfliTuning;
+
 typedef struct ZopfliOptionsMin {
   int numiterations;
   unsigned searchext;
@@ -108,6 +157,12 @@ typedef struct ZopfliOptionsMin {
 /* Initializes options with default values. */
 void ZopfliInitOptions(ZopfliOptions* options, unsigned mode, unsigned multithreading, unsigned isPNG);
 
+/* Initializes tuning to the defaults. */
+void ZopfliInitTuning(ZopfliTuning* tuning);
+
+/* Overrides the defaults in options with tuning. tuning may be NULL. */
+void ZopfliApplyTuning(ZopfliOptions* options, const ZopfliTuning* tuning);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -34,7 +34,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 (*size)++;\
 }
 
-static void ZopfliZipCompress(unsigned mode, unsigned multithreading,
+static void ZopfliZipCompress(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning,
                               const unsigned char* in, size_t insize, time_t time, std::string name,
                               unsigned char** out, size_t* outsize) {
   static const unsigned char filePKh[10]     = { 80, 75,  3,  4, 20,  0,  2,  0,  8,  0};
@@ -80,7 +80,7 @@ static void ZopfliZipCompress(unsigned mode, unsigned multithreading,
   for(i=0;i<max;++i) ZOPFLI_APPEND_DATA(infilename[i], out, outsize);
   unsigned long rawdeflsize = *outsize;
 
-  ZopfliBuffer(mode, multithreading, in, insize, out, outsize);
+  ZopfliBuffer(mode, multithreading, tuning, in, insize, out, outsize);
   *out = (unsigned char*)realloc(*out, 200 + *outsize);
 
   rawdeflsize = *outsize - rawdeflsize;
@@ -133,7 +133,7 @@ static void ZopfliZipCompress(unsigned mode, unsigned multithreading,
 /*
 Compresses the data according to the gzip specification.
 */
-static void ZopfliGzipCompress(unsigned mode, unsigned multithreading,
+static void ZopfliGzipCompress(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning,
                         const unsigned char* in, size_t insize, time_t time,
                         unsigned char** out, size_t* outsize, std::string name = "") {
   unsigned crcvalue = crc32(0, in, insize);
@@ -182,7 +182,7 @@ static void ZopfliGzipCompress(unsigned mode, unsigned multithreading,
     (*outsize) += stream.total_out;
   }
   else {
-    ZopfliBuffer(mode, multithreading, in, insize, out, outsize);
+    ZopfliBuffer(mode, multithreading, tuning, in, insize, out, outsize);
     (*out) = (unsigned char*)realloc(*out, *outsize + 8);
   }
 
@@ -272,7 +272,7 @@ static void SaveFile(const char* filename,
 /*
  outfilename: filename to write output to, or 0 to write to stdout instead
  */
-int ZopfliGzip(const char* infilename, const char* outfilename, unsigned mode, unsigned multithreading, unsigned ZIP, unsigned char isGZ, const char* gzip_name) {
+int ZopfliGzip(const char* infilename, const char* outfilename, unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, unsigned ZIP, unsigned char isGZ, const char* gzip_name) {
   unsigned char* in;
   long long insize = -1;
   unsigned char* out = 0;
@@ -293,10 +293,10 @@ int ZopfliGzip(const char* infilename, const char* outfilename, unsigned mode, u
   stat(infilename, &st);
   time_t time = st.st_mtime;
   if (!ZIP) {
-    ZopfliGzipCompress(mode, multithreading, in, insize, time, &out, &outsize, (std::string)(gzip_name ? gzip_name : ""));
+    ZopfliGzipCompress(mode, multithreading, tuning, in, insize, time, &out, &outsize, (std::string)(gzip_name ? gzip_name : ""));
   }
   else {
-    ZopfliZipCompress(mode, multithreading, in, insize, time, infilename, &out, &outsize);
+    ZopfliZipCompress(mode, multithreading, tuning, in, insize, time, infilename, &out, &outsize);
   }
   free(in);
 
@@ -306,9 +306,18 @@ int ZopfliGzip(const char* infilename, const char* outfilename, unsigned mode, u
   return EXIT_SUCCESS;
 }
 
-void ZopfliBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize) {
+void ZopfliGzipBuffer(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, const unsigned char* in, size_t insize, time_t time, const char* name, unsigned char** out, size_t* outsize) {
+  ZopfliGzipCompress(mode, multithreading, tuning, in, insize, time, out, outsize, (std::string)(name ? name : ""));
+}
+
+void ZopfliZipBuffer(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, const unsigned char* in, size_t insize, time_t time, const char* name, unsigned char** out, size_t* outsize) {
+  ZopfliZipCompress(mode, multithreading, tuning, in, insize, time, name, out, outsize);
+}
+
+void ZopfliBuffer(unsigned mode, unsigned multithreading, const ZopfliTuning* tuning, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize) {
   ZopfliOptions options;
   ZopfliInitOptions(&options, mode, multithreading, 0);
+  ZopfliApplyTuning(&options, tuning);
   unsigned char bp = 0;
   ZopfliDeflate(&options, 1, in, insize, &bp, out, outsize);
 }
@@ -19,6 +19,7 @@
 
 /*Modified by Felix Hanau*/
 
+#include <algorithm>
 #include <cstdio>
 #include <cassert>
 #include <set>
@@ -30,6 +31,13 @@
 #include "zopfli/deflate.h"
 #include "main.h"
 #include "lodepng/lodepng.h"
+#include "threadpool.h"
+#include "timing.h"
+#include "zlib/zlib.h"
+
+#ifndef NOMULTI
+#include <mutex>
+#endif
 
 struct ZopfliPNGOptions {
   ZopfliPNGOptions();
@@ -49,13 +57,21 @@ struct ZopfliPNGOptions {
   unsigned multithreading;
 
   unsigned quiet;
+
+  // Use a fast zlib pass instead of Zopfli, to rank filter strategies
+  bool estimate;
+
+  // Deflate settings besides the mode, see ZopfliTuning
+  ZopfliTuning tuning;
 };
 
 ZopfliPNGOptions::ZopfliPNGOptions()
 : lossy_transparent(true)
 , lossy_8bit(false)
 , strip(false)
+, estimate(false)
 {
+  ZopfliInitTuning(&tuning);
 }
 
 // Deflate compressor passed as function pointer to LodePNG to have it use Zopfli
@@ -65,10 +81,36 @@ static unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize, const uns
   unsigned char bp = 0;
   ZopfliOptions options;
   ZopfliInitOptions(&options, png_options->Mode, png_options->multithreading, 1);
+  ZopfliApplyTuning(&options, &png_options->tuning);
   ZopfliDeflate(&options, 1, in, insize, &bp, out, outsize);
   return 0;
 }
 
+// Fast replacement for CustomPNGDeflate used to estimate the compressed size.
+static unsigned EstimatePNGDeflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings) {
+  z_stream stream;
+  stream.zalloc = 0;
+  stream.zfree = 0;
+  stream.opaque = 0;
+  if (deflateInit2(&stream, 9, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+    return 83;
+  }
+  size_t bound = deflateBound(&stream, insize);
+  *out = (unsigned char*)malloc(bound);
+  if (!*out) {
+    deflateEnd(&stream);
+    return 83; // LodePNG's code for a failed allocation
+  }
+  stream.next_in = (z_const unsigned char *)in;
+  stream.avail_in = insize;
+  stream.next_out = *out;
+  stream.avail_out = bound;
+  deflate(&stream, Z_FINISH);
+  *outsize = stream.total_out;
+  deflateEnd(&stream);
+  return 0;
+}
+
 // Returns 32-bit integer value for RGBA color.
 static unsigned ColorIndex(const unsigned char* color) {
   return color[0] + (color[1] << 8) + (color[2] << 16) + (color[3] << 24);
@@ -355,12 +397,14 @@ static void LossyOptimizeTransparent(lodepng::State* inputstate, unsigned char*
 // Tries to optimize given a single PNG filter strategy.
 // Returns 0 if ok, other value for error
 static unsigned TryOptimize(unsigned char* image, size_t imagesize, unsigned w, unsigned h, bool bit16, const lodepng::State& inputstate,
-                            const ZopfliPNGOptions* png_options, std::vector<unsigned char>* out, int best_filter, std::vector<unsigned char> filters, unsigned palette_filter) {
+                            const ZopfliPNGOptions* png_options, std::vector<unsigned char>* out, int best_filter, const std::vector<unsigned char>& filters,
+                            unsigned palette_filter, const LodePNGColorStats* color_stats) {
   lodepng::State state;
-  state.encoder.zlibsettings.custom_deflate = CustomPNGDeflate;
+  state.encoder.zlibsettings.custom_deflate = png_options->estimate ? EstimatePNGDeflate : CustomPNGDeflate;
   state.encoder.zlibsettings.custom_context = png_options;
   state.encoder.clean_alpha = png_options->lossy_transparent;
   state.encoder.quiet = png_options->quiet;
+  state.encoder.color_stats = color_stats;
 
   ZopfliOptions dummyoptions;
   ZopfliInitOptions(&dummyoptions, png_options->Mode, 0, 0);
@@ -373,7 +417,7 @@ static unsigned TryOptimize(unsigned char* image, size_t imagesize, unsigned w,
   state.encoder.filter_strategy = (LodePNGFilterStrategy)best_filter;
   if (best_filter == 6)
   {
-    state.encoder.predefined_filters = &filters[0];
+    state.encoder.predefined_filters = filters.data();
     state.encoder.auto_convert = 0;
     lodepng_color_mode_copy(&state.info_png.color, &inputstate.info_png.color);
   }
@@ -393,6 +437,7 @@ static unsigned TryOptimize(unsigned char* image, size_t imagesize, unsigned w,
 
   // Try different ways to sort palette
   if (!error && state.out_mode.colortype == LCT_PALETTE && palette_filter && state.out_mode.palettesize > 1) {
+    double timing = TimingStart();
     p._first = 1;
     std::vector<unsigned char> out2;
     unsigned tries = 0;
@@ -430,6 +475,7 @@ static unsigned TryOptimize(unsigned char* image, size_t imagesize, unsigned w,
         }
       }
     }
+    TimingStage("palette", timing, imagesize, out->size());
   }
 
   // For very small output, also try without palette, it may be smaller thanks
@@ -477,77 +523,304 @@ static unsigned TryOptimize(unsigned char* image, size_t imagesize, unsigned w,
   return error;
 }
 
-static unsigned ZopfliPNGOptimize(const char * Infile, const std::vector<unsigned char>& origpng, const ZopfliPNGOptions& png_options, std::vector<unsigned char>* resultpng, int best_filter,
-                                  std::vector<unsigned char> filters, unsigned palette_filter) {
-  unsigned char* image = 0;
-  size_t imagesize = 0;
-  unsigned w, h;
+// Keeps a decoded PNG in memory so that several filter strategies can be tried
+// without reloading the file. Only the smallest result is kept. Trials may run
+// concurrently; ties go to the trial that was started first.
+struct ZopfliPNGSession {
+  std::string name;
+  std::vector<unsigned char> origpng;
+  ZopfliPNGOptions png_options;
+  bool strict;
+
+  // Decoded once, shared by all trials
   lodepng::State inputstate;
+  unsigned char* image;
+  size_t imagesize;
+  unsigned w, h;
+  bool bit16;
 
-  unsigned error = lodepng::decode(&image, imagesize, w, h, inputstate, &origpng[0], origpng.size());
+  // Filters of the input, only loaded when filter 6 is tried
+  std::vector<unsigned char> filters;
+  // Chunks to copy into every trial unless stripping
+  std::vector<std::string> names[3];
+  std::vector<std::vector<unsigned char> > chunks[3];
+
+  // Color statistics for each variant of the transparent pixels (filters 0-4 and untouched)
+  LodePNGColorStats stats[6];
+  bool have_stats[6];
+
+  std::vector<unsigned char> best;
+  unsigned best_order;
+  unsigned trials;
+#ifndef NOMULTI
+  std::mutex mtx;
+#endif
+};
 
-  bool bit16 = false;  // Using 16-bit per channel raw image
-  if (!error && inputstate.info_png.color.bitdepth == 16 && !png_options.lossy_8bit) {
-    // Decode as 16-bit
-    free(image);
-    error = lodepng::decode(&image, imagesize, w, h, &origpng[0], origpng.size(), LCT_RGBA, 16);
-    bit16 = true;
+ZopfliPNGSession* ZopfliPNGSessionOpenBuffer(const std::vector<unsigned char>& origpng, bool strip, bool strict, unsigned Mode, unsigned multithreading, const ZopfliTuning* tuning,
+                                       unsigned quiet, const char * name) {
+  if (!origpng.size()) {
+    fprintf(stderr, "%s: Empty PNG\n", name);
+    return 0;
+  }
+  ZopfliPNGSession* session = new ZopfliPNGSession;
+  session->name = name;
+  session->origpng = origpng;
+  session->png_options.Mode = Mode;
+  session->png_options.multithreading = multithreading;
+  if (tuning) {
+    session->png_options.tuning = *tuning;
+  }
+  session->png_options.quiet = quiet;
+  session->png_options.strip = strip;
+  session->strict = strict;
+  session->image = 0;
+  session->imagesize = 0;
+  session->bit16 = false;
+  session->best_order = 0;
+  session->trials = 0;
+  for (unsigned i = 0; i < 6; i++) {
+    session->have_stats[i] = false;
   }
 
+  double timing = TimingStart();
+  unsigned error = lodepng::decode(&session->image, session->imagesize, session->w, session->h, session->inputstate, &origpng[0], origpng.size());
+  if (!error && session->inputstate.info_png.color.bitdepth == 16 && !session->png_options.lossy_8bit) {
+    // Decode as 16-bit
+    free(session->image);
+    session->image = 0;
+    error = lodepng::decode(&session->image, session->imagesize, session->w, session->h, &origpng[0], origpng.size(), LCT_RGBA, 16);
+    session->bit16 = true;
+  }
+  TimingStage("decode", timing, origpng.size(), session->imagesize);
   if (error) {
-    fprintf(stderr, "%s decoding error %i: %s\n", Infile, error, lodepng_error_text(error));
-    return error;
+    fprintf(stderr, "%s decoding error %i: %s\n", name, error, lodepng_error_text(error));
+    free(session->image);
+    delete session;
+    return 0;
+  }
+  if (!strip) {
+    lodepng::getChunks(session->names, session->chunks, origpng);
   }
+  return session;
+}
+
+ZopfliPNGSession* ZopfliPNGSessionOpen(const char * Infile, bool strip, bool strict, unsigned Mode, unsigned multithreading, const ZopfliTuning* tuning, unsigned quiet) {
+  std::vector<unsigned char> origpng;
+  if (lodepng::load_file(origpng, Infile)) {
+    fprintf(stderr, "Could not load PNG %s\n", Infile);
+    return 0;
+  }
+  return ZopfliPNGSessionOpenBuffer(origpng, strip, strict, Mode, multithreading, tuning, quiet, Infile);
+}
+
+// Encodes the image with the given filter strategy. Returns 0 if ok, -1 on error.
+static int SessionEncode(ZopfliPNGSession* session, int filter, bool estimate, std::vector<unsigned char>& resultpng) {
+  char stage[32];
+  snprintf(stage, sizeof(stage), "%s %d", estimate ? "estimate" : "filter", filter & 0xFF);
+  double timing = TimingStart();
+  unsigned palette_filter = estimate ? 0 : (filter & 0xFF00) >> 8;
+  filter &= 0xFF;
+  ZopfliPNGOptions png_options = session->png_options;
+  png_options.lossy_transparent = !session->strict && filter != 6;
+  png_options.estimate = estimate;
+
+  if (filter == 6) {
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(session->mtx);
+#endif
+    if (!session->filters.size()) {
+      lodepng::getFilterTypes(session->filters, session->origpng);
+    }
+    if (!session->filters.size()) {
+      fprintf(stderr, "%s: Could not load PNG filters\n", session->name.c_str());
+      return -1;
+    }
+  }
+
   // If lossy_transparent, remove RGB information from pixels with alpha=0
-  if (png_options.lossy_transparent && !bit16 && lodepng_can_have_alpha(&inputstate.info_png.color)) {
-    LossyOptimizeTransparent(&inputstate, image, w, h, best_filter < 5 ? best_filter : 1);
+  unsigned char* image = session->image;
+  unsigned variant = 5;
+  if (png_options.lossy_transparent && !session->bit16 && lodepng_can_have_alpha(&session->inputstate.info_png.color)) {
+    variant = filter < 5 ? filter : 1;
+    image = (unsigned char*)malloc(session->imagesize);
+    if (!image) {
+      fprintf(stderr, "%s: Out of memory\n", session->name.c_str());
+      return -1;
+    }
+    memcpy(image, session->image, session->imagesize);
+    LossyOptimizeTransparent(&session->inputstate, image, session->w, session->h, variant);
   }
 
-  error = TryOptimize(image, imagesize, w, h, bit16, inputstate, &png_options, resultpng, best_filter, filters, palette_filter);
-  free(image);
+  const LodePNGColorStats* stats = 0;
+  if (filter != 6) {
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(session->mtx);
+#endif
+    if (!session->have_stats[variant]) {
+      LodePNGColorMode raw;
+      lodepng_color_mode_init(&raw);
+      raw.bitdepth = session->bit16 ? 16 : 8;
+      lodepng_color_stats_init(&session->stats[variant]);
+      if (!lodepng_compute_color_stats(&session->stats[variant], image, session->w, session->h, &raw)) {
+        session->have_stats[variant] = true;
+      }
+    }
+    if (session->have_stats[variant]) {
+      stats = &session->stats[variant];
+    }
+  }
+
+  unsigned error = TryOptimize(image, session->imagesize, session->w, session->h, session->bit16, session->inputstate, &png_options, &resultpng,
+                               filter, session->filters, palette_filter, stats);
+  if (image != session->image) {
+    free(image);
+  }
   if (error) {
-    fprintf(stderr, "%s encoding error %u: %s\n", Infile, error, lodepng_error_text(error));
-    return error;
+    fprintf(stderr, "%s encoding error %u: %s\n", session->name.c_str(), error, lodepng_error_text(error));
+    return -1;
   }
   if (!png_options.strip) {
-    std::vector<std::string> names[3];
-    std::vector<std::vector<unsigned char> > chunks[3];
-    lodepng::getChunks(names, chunks, origpng);
-    lodepng::insertChunks(*resultpng, chunks);
+    lodepng::insertChunks(resultpng, session->chunks);
   }
+  TimingStage(stage, timing, session->imagesize, resultpng.size());
   return 0;
 }
 
-int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned quiet) {
-  ZopfliPNGOptions png_options;
-  png_options.Mode = Mode;
-  png_options.multithreading = multithreading;
-  png_options.quiet = quiet;
-  unsigned palette_filter = (filter & 0xFF00) >> 8;
-  filter &= 0xFF;
-  png_options.lossy_transparent = !strict && filter != 6;
-  png_options.strip = strip;
-  std::vector<unsigned char> origpng;
-
-  std::vector<unsigned char> filters;
-  unsigned error = lodepng::load_file(origpng, Infile);
-  if (error) {
-    fprintf(stderr, "Could not load PNG %s\n", Infile);
+// Returns 0 if the trial is the smallest result so far, 1 if not, -1 on error.
+static int SessionTrial(ZopfliPNGSession* session, int filter, unsigned order) {
+  std::vector<unsigned char> resultpng;
+  if (SessionEncode(session, filter, false, resultpng)) {
     return -1;
   }
-  if (filter == 6){
-    lodepng::getFilterTypes(filters, origpng);
-    if(!filters.size()){
-      fprintf(stderr, "%s: Could not load PNG filters\n", Infile);
+#ifndef NOMULTI
+  std::lock_guard<std::mutex> lock(session->mtx);
+#endif
+  if (!session->best.size()) {
+    if (resultpng.size() >= session->origpng.size()) {
+      return 1;
+    }
+  }
+  else if (resultpng.size() > session->best.size() || (resultpng.size() == session->best.size() && order > session->best_order)) {
+    return 1;
+  }
+  session->best.swap(resultpng);
+  session->best_order = order;
+  return 0;
+}
+
+int ZopfliPNGSessionTry(ZopfliPNGSession* session, int filter) {
+  return SessionTrial(session, filter, session->trials++);
+}
+
+int ZopfliPNGSessionTryAll(ZopfliPNGSession* session, const int* filters, unsigned n, unsigned top) {
+  std::vector<int> results(n, 1);
+  unsigned first = session->trials;
+  session->trials += n;
+
+  // Rank the strategies by a fast estimate and only compress the best ones with Zopfli
+  std::vector<unsigned> candidates;
+  if (top && top < n) {
+    std::vector<size_t> estimates(n);
+    TaskGroup group;
+    for (unsigned i = 0; i < n; i++) {
+      group.Run([session, filters, i, &estimates, &results]{
+        std::vector<unsigned char> resultpng;
+        results[i] = SessionEncode(session, filters[i], true, resultpng);
+        estimates[i] = resultpng.size();
+      });
+    }
+    group.Wait();
+    if (results[0] < 0) {
       return -1;
     }
+    for (unsigned i = 0; i < n; i++) {
+      if (!results[i]) {
+        candidates.push_back(i);
+      }
+      results[i] = 1;
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), [&estimates](unsigned a, unsigned b){return estimates[a] < estimates[b];});
+    if (candidates.size() > top) {
+      candidates.resize(top);
+    }
   }
-  std::vector<unsigned char> resultpng;
-  if (ZopfliPNGOptimize(Infile, origpng, png_options, &resultpng, filter, filters, palette_filter)) {return -1;}
-  if (resultpng.size() >= origpng.size()) {return 1;}
-  if (lodepng::save_file(resultpng, Infile) != 0) {
-    fprintf(stderr, "Failed to write to file %s\n", Infile);
+  else {
+    for (unsigned i = 0; i < n; i++) {
+      candidates.push_back(i);
+    }
+  }
+
+  TaskGroup group;
+  for (unsigned i : candidates) {
+    bool required = i == candidates[0];
+    group.Run([session, filters, first, i, required, &results]{
+      //Out of time: skip the remaining strategies, but always produce one result
+      if (!required && TimingDeadlineExpired()) {
+        return;
+      }
+      results[i] = SessionTrial(session, filters[i], first + i);
+    });
+  }
+  group.Wait();
+  if (n && results[0] < 0) {
     return -1;
   }
-  return 0;
+  for (unsigned i = 0; i < n; i++) {
+    if (!results[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const std::vector<unsigned char>& ZopfliPNGSessionBest(const ZopfliPNGSession* session) {
+  return session->best;
+}
+
+void ZopfliPNGSessionFree(ZopfliPNGSession* session) {
+  free(session->image);
+  delete session;
+}
+
+int ZopfliPNGSessionClose(ZopfliPNGSession* session) {
+  int x = 1;
+  if (session->best.size()) {
+    x = 0;
+    double timing = TimingStart();
+    if (lodepng::save_file(session->best, session->name.c_str()) != 0) {
+      fprintf(stderr, "Failed to write to file %s\n", session->name.c_str());
+      x = -1;
+    }
+    TimingStage("write", timing, session->best.size(), session->best.size());
+  }
+  ZopfliPNGSessionFree(session);
+  return x;
+}
+
+int ZopflipngBuffer(bool strip, const std::vector<unsigned char>& origpng, bool strict, unsigned Mode, int filter, unsigned multithreading, const ZopfliTuning* tuning, unsigned quiet,
+                    std::vector<unsigned char>& resultpng, const char * name) {
+  ZopfliPNGSession* session = ZopfliPNGSessionOpenBuffer(origpng, strip, strict, Mode, multithreading, tuning, quiet, name);
+  if (!session) {
+    return -1;
+  }
+  int x = ZopfliPNGSessionTry(session, filter);
+  if (!x) {
+    resultpng.swap(session->best);
+  }
+  ZopfliPNGSessionFree(session);
+  return x;
+}
+
+int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, const ZopfliTuning* tuning, unsigned quiet) {
+  ZopfliPNGSession* session = ZopfliPNGSessionOpen(Infile, strip, strict, Mode, multithreading, tuning, quiet);
+  if (!session) {
+    return -1;
+  }
+  int x = ZopfliPNGSessionTry(session, filter);
+  if (x) {
+    ZopfliPNGSessionFree(session);
+    return x;
+  }
+  return ZopfliPNGSessionClose(session);
 }